@@ -24,6 +24,7 @@
 
 #include <arpa/inet.h>
 #include <netinet/tcp.h>
+#include <sys/uio.h>
 
 #include "mbedtls/net_sockets.h"
 #include "mbedtls/error.h"
@@ -51,6 +52,12 @@ struct est_conn {
 	bool encrypted;
 	struct tls tls;
 	int socket;
+
+	/* Gathered TLS writes are staged here to go out as one record */
+	uint8_t *tx_buf;
+	uint32_t tx_buf_size;
+	/* Unsent part of the staged data on a non-blocking link */
+	struct iovec tx_iov;
 };
 
 int network_send(struct est_conn *link, uint8_t *data, uint32_t len);
@@ -60,10 +67,17 @@ void network_close_link(struct est_conn *link);
 void network_shut_link(struct est_conn *link);
 void network_close_tcp(struct est_conn *link);
 void network_shut_tcp(struct est_conn *link);
+bool network_set_nonblocking_tcp(struct est_conn *link);
 bool network_recv_data(struct est_conn *link, uint8_t *data, uint32_t len);
 bool network_send_data(struct est_conn *link, uint8_t *data, uint32_t len);
+bool network_send_iov(struct est_conn *link, struct iovec *iov, int iovcnt);
+bool network_send_iov_nb(struct est_conn *link, struct iovec **iov, int *iovcnt, bool more);
+bool network_set_nonblocking(struct est_conn *link);
+bool network_would_block(struct est_conn *link, int ret);
+int network_link_fd(struct est_conn *link);
 void network_close_tls(struct est_conn *link);
 void network_shut_tls(struct est_conn *link);
+bool network_set_nonblocking_tls(struct est_conn *link);
 int network_tls_send(struct est_conn *link, uint8_t *data, uint32_t len);
 int network_tls_recv(struct est_conn *link, uint8_t *data, uint32_t len);
 
@@ -44,6 +44,9 @@
 #define USBIP_DIR_OUT		0x00
 #define USBIP_DIR_IN		0x01
 
+/* Same limit as the kernel, a larger count is a broken client */
+#define USBIP_MAX_ISO_PACKETS	1024
+
 struct usbip_header_basic {
 	uint32_t command;
 	uint32_t seqnum;
@@ -134,11 +137,19 @@ struct usbip_op_devlist_reply {
 struct usb_packet {
 	bool				ready;
 	bool				submitted;
+	bool				credited;
+	bool				speculative;	/* Read ahead of the client */
+	bool				parked;		/* Waits for a read ahead */
+	bool				answered;	/* Completed without the device */
 	uint32_t			unlinked;
+	uint32_t			buf_size;
 	struct usbip_header		hdr;
 	struct libusb_transfer		*xfer;
+	struct usbip_iso_packet_descriptor *iso_desc;
 	struct forward_info		*f_dev;
+	struct ep_queue			*ep_queue;
 	struct usb_packet		*next;
+	struct usb_packet		*hnext;
 };
 
 bool usbip_net_send_usbip_header(struct est_conn *link, struct usbip_op_common *hdr);
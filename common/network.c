@@ -64,6 +64,180 @@ bool network_send_data(struct est_conn *link, uint8_t *data, uint32_t len)
 	return true;
 }
 
+/* Skips the first len bytes of the vectors */
+static void network_iov_advance(struct iovec **iov, int *iovcnt, size_t len)
+{
+	while (*iovcnt > 0 && len >= (*iov)->iov_len) {
+		len -= (*iov)->iov_len;
+		(*iov)++;
+		(*iovcnt)--;
+	}
+
+	if (*iovcnt > 0) {
+		(*iov)->iov_base = (uint8_t *)(*iov)->iov_base + len;
+		(*iov)->iov_len -= len;
+	}
+}
+
+/* more tells that another write follows at once, also after the last chunk */
+static ssize_t network_sendmsg(struct est_conn *link, struct iovec *iov, int iovcnt, bool more)
+{
+	struct msghdr msg = {0};
+
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iovcnt > UIO_MAXIOV ? UIO_MAXIOV : iovcnt;
+
+	/* Let the stack fill full segments across UIO_MAXIOV sized chunks */
+	errno = 0;
+	return sendmsg(link->socket, &msg,
+		       MSG_NOSIGNAL | (iovcnt > UIO_MAXIOV || more ? MSG_MORE : 0));
+}
+
+static bool network_send_iov_tcp(struct est_conn *link, struct iovec *iov, int iovcnt)
+{
+	ssize_t ret;
+
+	while (iovcnt > 0) {
+		ret = network_sendmsg(link, iov, iovcnt, false);
+		if (ret <= 0) {
+			rh_trace(LVL_WARN, "Network sendmsg fail %d, %zd\n", errno, ret);
+			return false;
+		}
+
+		network_iov_advance(&iov, &iovcnt, ret);
+	}
+
+	return true;
+}
+
+/* Copies the vectors into the TLS staging buffer, tx_iov covers the result */
+static bool network_stage_iov(struct est_conn *link, struct iovec *iov, int iovcnt)
+{
+	uint8_t *buf;
+	uint32_t len = 0;
+
+	for (int i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+
+	if (len > link->tx_buf_size) {
+		buf = realloc(link->tx_buf, len);
+		if (!buf) {
+			rh_trace(LVL_ERR, "Out of memory\n");
+			return false;
+		}
+		link->tx_buf = buf;
+		link->tx_buf_size = len;
+	}
+
+	len = 0;
+	for (int i = 0; i < iovcnt; i++) {
+		memcpy(&link->tx_buf[len], iov[i].iov_base, iov[i].iov_len);
+		len += iov[i].iov_len;
+	}
+
+	link->tx_iov.iov_base = link->tx_buf;
+	link->tx_iov.iov_len = len;
+
+	return true;
+}
+
+static bool network_send_iov_tls(struct est_conn *link, struct iovec *iov, int iovcnt)
+{
+	if (!network_stage_iov(link, iov, iovcnt))
+		return false;
+
+	return network_send_data(link, link->tx_iov.iov_base, link->tx_iov.iov_len);
+}
+
+/* Sends all of the vectors with as few writes as possible, iov is consumed */
+bool network_send_iov(struct est_conn *link, struct iovec *iov, int iovcnt)
+{
+	return link->encrypted ? network_send_iov_tls(link, iov, iovcnt) :
+				 network_send_iov_tcp(link, iov, iovcnt);
+}
+
+static bool network_send_iov_tcp_nb(struct est_conn *link, struct iovec **iov, int *iovcnt,
+				    bool more)
+{
+	ssize_t ret;
+
+	while (*iovcnt > 0) {
+		ret = network_sendmsg(link, *iov, *iovcnt, more);
+		if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return true;
+		if (ret <= 0) {
+			rh_trace(LVL_WARN, "Network sendmsg fail %d, %zd\n", errno, ret);
+			return false;
+		}
+
+		network_iov_advance(iov, iovcnt, ret);
+	}
+
+	return true;
+}
+
+/*
+ * A TLS write that would block has to be repeated with the same data, so the
+ * vectors are staged once and the rest of tx_iov is retried on later calls.
+ */
+static bool network_send_iov_tls_nb(struct est_conn *link, struct iovec **iov, int *iovcnt)
+{
+	int ret;
+
+	if (*iov != &link->tx_iov) {
+		if (!network_stage_iov(link, *iov, *iovcnt))
+			return false;
+		*iov = &link->tx_iov;
+		*iovcnt = 1;
+	}
+
+	while (*iovcnt > 0) {
+		ret = network_tls_send(link, link->tx_iov.iov_base, link->tx_iov.iov_len);
+		if (network_would_block(link, ret))
+			return true;
+		if (ret <= 0) {
+			rh_trace(LVL_WARN, "Network send fail %d\n", ret);
+			return false;
+		}
+
+		network_iov_advance(iov, iovcnt, ret);
+	}
+
+	return true;
+}
+
+/*
+ * Sends what the socket takes without blocking. iov and iovcnt are advanced
+ * past the sent data, iovcnt is zero once everything is out. With more set
+ * the stack may hold a partial segment for the write that follows, TLS
+ * records are written as they are.
+ */
+bool network_send_iov_nb(struct est_conn *link, struct iovec **iov, int *iovcnt, bool more)
+{
+	return link->encrypted ? network_send_iov_tls_nb(link, iov, iovcnt) :
+				 network_send_iov_tcp_nb(link, iov, iovcnt, more);
+}
+
+bool network_set_nonblocking(struct est_conn *link)
+{
+	return link->encrypted ? network_set_nonblocking_tls(link) :
+				 network_set_nonblocking_tcp(link);
+}
+
+/* Tells if a failed network_send or network_recv only has to be retried later */
+bool network_would_block(struct est_conn *link, int ret)
+{
+	if (link->encrypted)
+		return ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE;
+
+	return ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+int network_link_fd(struct est_conn *link)
+{
+	return link->encrypted ? link->tls.socket_fd.MBEDTLS_PRIVATE(fd) : link->socket;
+}
+
 bool network_recv_data(struct est_conn *link, uint8_t *data, uint32_t len)
 {
 	int ret;
@@ -88,6 +262,10 @@ void network_close_link(struct est_conn *link)
 		network_close_tcp(link);
 	else
 		network_close_tls(link);
+
+	free(link->tx_buf);
+	link->tx_buf = NULL;
+	link->tx_buf_size = 0;
 }
 
 void network_shut_link(struct est_conn *link)
@@ -20,6 +20,7 @@
 #include <stdint.h>
 #include <unistd.h>
 #include <stdbool.h>
+#include <fcntl.h>
 
 #include "network.h"
 #include "logging.h"
@@ -35,3 +36,13 @@ void network_shut_tcp(struct est_conn *link)
 	if (link->socket)
 		shutdown(link->socket, SHUT_RDWR);
 }
+
+bool network_set_nonblocking_tcp(struct est_conn *link)
+{
+	int flags = fcntl(link->socket, F_GETFL);
+
+	if (flags < 0)
+		return false;
+
+	return fcntl(link->socket, F_SETFL, flags | O_NONBLOCK) == 0;
+}
@@ -50,6 +50,12 @@ void network_shut_tls(struct est_conn *link)
 	shutdown(link->tls.socket_fd.MBEDTLS_PRIVATE(fd), SHUT_RDWR);
 }
 
+/* mbedtls reports EAGAIN as WANT_READ/WANT_WRITE only on O_NONBLOCK sockets */
+bool network_set_nonblocking_tls(struct est_conn *link)
+{
+	return mbedtls_net_set_nonblock(&link->tls.socket_fd) == 0;
+}
+
 int network_tls_send(struct est_conn *link, uint8_t *data, uint32_t len)
 {
 	return mbedtls_ssl_write(&link->tls.ssl, data, len);
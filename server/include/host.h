@@ -22,6 +22,10 @@
 
 #include <stdbool.h>
 
+#define HOST_HANDSHAKE_WORKERS		8	/* Concurrent handshakes */
+#define HOST_PENDING_MAX		64	/* Accepted, waiting for a worker */
+#define HOST_HANDSHAKE_TIMEOUT_MS	5000	/* Handshake and the op header */
+
 bool host_task_init(struct server_info info);
 void host_exit(void);
 
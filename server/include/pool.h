@@ -0,0 +1,98 @@
+/*
+ * Copyright (C) 2021 Jani Laitinen
+ *
+ * This file is part of RemoteHub.
+ *
+ * RemoteHub is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * RemoteHub is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with RemoteHub.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __REMOTEHUB_SERVER_POOL_H__
+#define __REMOTEHUB_SERVER_POOL_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <pthread.h>
+#include <libusb-1.0/libusb.h>
+
+#include "usbip.h"
+
+/* Data buffer size classes are 1k, 4k, 16k, 64k, 256k and 1M */
+#define POOL_BUF_CLASSES		6
+#define POOL_BUF_MIN_SHIFT		10
+#define POOL_BUF_CLASS_SHIFT		2
+#define POOL_BUFS_PER_CHUNK		8
+#define POOL_HUGEPAGE_SIZE		(2 * 1024 * 1024)
+
+/* Transfer class 0 has no ISO packets, class n has room for 1 << (n - 1) */
+#define POOL_XFER_CLASSES		12
+
+/* Scratch areas are each owned by a single thread */
+enum pool_scratch {
+	POOL_SCRATCH_RX_BUF,
+	POOL_SCRATCH_RX_ISO,
+	POOL_SCRATCH_TX_IOV,
+	POOL_SCRATCH_COUNT
+};
+
+struct pool_stats {
+	uint64_t	hits;
+	uint64_t	misses;
+	uint64_t	current_bytes;
+	uint64_t	peak_bytes;
+};
+
+/* usbfs DMA memory appeared in libusb 1.0.21 */
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+#define POOL_HAVE_DEV_MEM
+#endif
+
+struct pool_chunk {
+	uint8_t			*mem;
+	size_t			size;
+	bool			dev_mem;
+	struct pool_chunk	*next;
+};
+
+struct packet_pool {
+	pthread_mutex_t		lock;
+	bool			hugepages;
+	bool			dev_mem;
+	libusb_device_handle	*handle;
+
+	struct usb_packet	*packets;
+	struct libusb_transfer	*xfers[POOL_XFER_CLASSES];
+	uint8_t			*bufs[POOL_BUF_CLASSES];
+	struct pool_chunk	*chunks;
+
+	uint8_t			*scratch[POOL_SCRATCH_COUNT];
+	uint32_t		scratch_size[POOL_SCRATCH_COUNT];
+
+	struct pool_stats	stats;
+};
+
+bool pool_init(struct packet_pool *pool, bool hugepages, libusb_device_handle *handle);
+void pool_destroy(struct packet_pool *pool);
+
+struct usb_packet *pool_get_packet(struct packet_pool *pool);
+void pool_put_packet(struct packet_pool *pool, struct usb_packet *packet);
+struct libusb_transfer *pool_get_transfer(struct packet_pool *pool, int num_iso);
+void pool_put_transfer(struct packet_pool *pool, struct libusb_transfer *xfer);
+uint8_t *pool_get_buffer(struct packet_pool *pool, uint32_t size);
+void pool_put_buffer(struct packet_pool *pool, uint8_t *buf, uint32_t size);
+uint8_t *pool_get_scratch(struct packet_pool *pool, enum pool_scratch id, uint32_t size);
+
+void pool_get_stats(struct packet_pool *pool, struct pool_stats *stats);
+
+#endif /* __REMOTEHUB_SERVER_POOL_H__ */
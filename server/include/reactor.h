@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) 2021 Jani Laitinen
+ *
+ * This file is part of RemoteHub.
+ *
+ * RemoteHub is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * RemoteHub is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with RemoteHub.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __REMOTEHUB_SERVER_REACTOR_H__
+#define __REMOTEHUB_SERVER_REACTOR_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <libusb-1.0/libusb.h>
+
+#define REACTOR_MAX_WORKERS		16
+#define REACTOR_MAX_EVENTS		32
+#define REACTOR_TICK_MS			100	/* libusb timeouts without a pollfd */
+#define REACTOR_MAX_USB_CONTEXTS	16
+
+struct reactor_source {
+	int				fd;
+	uint32_t			events;
+	/* Runs on any worker, an EPOLLONESHOT source only on one at a time */
+	void				(*handler)(struct reactor_source *src, uint32_t events);
+	void				*data;
+	struct reactor_source		*next;
+};
+
+bool reactor_init(libusb_context **ctx, int ctx_count);
+void reactor_exit(void);
+
+bool reactor_add(struct reactor_source *src);
+bool reactor_rearm(struct reactor_source *src);
+void reactor_remove(struct reactor_source *src);
+void reactor_quiesce(void);
+void reactor_set_flush(void (*flush)(void));
+
+#endif /* __REMOTEHUB_SERVER_REACTOR_H__ */
@@ -27,16 +27,80 @@
 #include "remotehub.h"
 
 #define KEY_PASSWORD_MAX_LEN	128
+#define FLOW_CLASS_MAX_COUNT	16
+#define COALESCE_CLASS_MAX_COUNT 16
+#define WARM_DEVICE_MAX_COUNT	16
+
+/* Completed transfers of the endpoint types in ep_types share writes */
+struct tx_coalesce_policy {
+	bool enabled;
+	uint32_t latency_us;
+	uint32_t max_bytes;
+	uint8_t ep_types;
+};
+
+/* Replaces the default policy for the devices of one USB class */
+struct tx_coalesce_class {
+	uint8_t usb_class;
+	struct tx_coalesce_policy policy;
+};
+
+struct tx_coalesce_info {
+	struct tx_coalesce_policy policy;
+	uint32_t class_count;
+	struct tx_coalesce_class classes[COALESCE_CLASS_MAX_COUNT];
+};
+
+/* Bytes and URBs a device may have between reception and reply */
+struct flow_budget {
+	uint32_t byte_budget;
+	uint32_t urb_limit;
+};
+
+/* Overrides the speed based defaults for one USB class, zero keeps the default */
+struct flow_class_budget {
+	uint8_t usb_class;
+	struct flow_budget budget;
+};
+
+struct flow_control_info {
+	struct flow_budget usb2;
+	struct flow_budget usb3;
+	uint32_t class_count;
+	struct flow_class_budget classes[FLOW_CLASS_MAX_COUNT];
+};
+
+/* Replaces the default grace period for one device, by busid or else by VID:PID */
+struct warm_device {
+	char busid[USBIP_BUSID_SIZE];	/* Empty to match by VID:PID */
+	uint16_t vid;
+	uint16_t pid;
+	uint32_t seconds;		/* 0 never keeps the device warm */
+};
+
+struct warm_info {
+	uint32_t seconds;	/* Devices stay claimed this long after an export */
+	uint32_t device_count;
+	struct warm_device devices[WARM_DEVICE_MAX_COUNT];
+};
 
 struct server_info {
 	bool tls_enabled;
 	bool bcast_enabled;
+	bool pool_hugepages;
+	bool io_uring;
+	uint32_t usb_contexts;	/* 0 for one per core */
+	uint32_t int_prefetch;	/* Interrupt IN reads kept ahead, 0 for off */
+	bool bot_readahead;	/* Mass storage READs read ahead of the client */
 	uint16_t port;
 	char server_name[RH_SERVER_NAME_MAX_LEN];
 	char cert_path[PATH_MAX];
 	char key_path[PATH_MAX];
 	char ca_path[PATH_MAX];
 	char key_pass[KEY_PASSWORD_MAX_LEN];
+	struct tx_coalesce_info tx_coalesce;
+	struct flow_control_info flow_control;
+	struct warm_info warm;
 };
 
 enum usb_dev_state {
@@ -46,6 +110,40 @@ enum usb_dev_state {
 	UNEXPORTED
 };
 
+struct rh_devicelist_removal {
+	uint64_t generation;
+	char busid[USBIP_BUSID_SIZE];
+};
+
+/*
+ * Immutable snapshot of the local devices. A new one is made when the
+ * generation changes, a taken reference keeps the old one alive.
+ */
+struct rh_devicelist {
+	uint64_t generation;
+	uint32_t refs;
+	int count;
+	struct usb_device_info *devices;
+	/* Generation in which each device was added or last changed */
+	uint64_t *changed;
+
+	/* Recent removals, complete for diffs since removed_since or later */
+	uint64_t removed_since;
+	int removed_count;
+	struct rh_devicelist_removal *removed;
+
+	/* Ready made OP_REP_DEVLIST in network order */
+	uint32_t wire_len;
+	uint8_t *wire;
+};
+
+struct rh_devicelist *rh_devicelist_get(void);
+void rh_devicelist_put(struct rh_devicelist *list);
+bool rh_devicelist_diff(const struct rh_devicelist *list, uint64_t since,
+			void (*changed)(const struct usb_device_info *info, void *ctx),
+			void (*removed)(const char *busid, void *ctx), void *ctx);
+
+/* Called when the device list has changed */
 void rh_devicelist_subscribe(void (*callback)(struct usb_device_info *devlist, int count));
 void rh_attached_subscribe(void (*callback)(enum usb_dev_state state, struct usbip_usb_device dev));
 void rh_attached_unsubscribe(void);
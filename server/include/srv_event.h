@@ -29,6 +29,10 @@
 #define EVENT_DEVICE_UNEXPORTED			0x0040
 #define EVENT_DEVICE_ATTACHED			0x0080
 #define EVENT_DEVICE_DETACHED			0x0100
+#define EVENT_USB_HOTPLUG			0x0200
+#define EVENT_USB_STRINGS			0x0400
+#define EVENT_USB_IMPORTED			0x0800
+#define EVENT_FORWARD_STOPPED			0x1000
 
 
 #endif /* __REMOTEHUB_SRV_EVENT_H__ */
@@ -44,13 +44,17 @@ struct server_conn {
 	struct server_info	info;
 };
 
-bool network_listen(struct server_conn *conn, struct est_conn *link);
+#define SERVER_LISTEN_BACKLOG		64
+
+bool network_accept(struct server_conn *conn, struct est_conn *link);
+bool network_handshake(struct server_conn *conn, struct est_conn *link, uint32_t timeout_ms);
 bool network_create_server(struct server_conn *conn);
 bool network_create_tcp_server(struct server_conn *conn);
-bool network_listen_tcp(struct server_conn *conn, struct est_conn *link);
+bool network_accept_tcp(struct server_conn *conn, struct est_conn *link);
 
 bool network_create_tls_server(struct server_conn *conn);
-bool network_listen_tls(struct server_conn *conn, struct est_conn *link);
+bool network_accept_tls(struct server_conn *conn, struct est_conn *link);
+bool network_handshake_tls(struct server_conn *conn, struct est_conn *link, uint32_t timeout_ms);
 void network_exit_server_tls(struct server_conn *conn);
 
 #endif /* __REMOTEHUB_SRV_NETWORK_H__ */
@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2021 Jani Laitinen
+ *
+ * This file is part of RemoteHub.
+ *
+ * RemoteHub is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * RemoteHub is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with RemoteHub.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __REMOTEHUB_SERVER_URING_H__
+#define __REMOTEHUB_SERVER_URING_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#define URING_ENTRIES			256
+#define URING_BUF_COUNT			256	/* Must be a power of two */
+#define URING_BUF_SIZE			(16 * 1024)
+#define URING_BUF_GROUP			0
+#define URING_REAP_BATCH		32
+
+enum uring_op_type {
+	URING_OP_RECV,
+	URING_OP_SEND,
+	URING_OP_CANCEL,
+};
+
+struct uring_link;
+
+struct uring_op {
+	enum uring_op_type		type;
+	struct uring_link		*link;
+};
+
+enum uring_send_state {
+	URING_SEND_BUSY,
+	URING_SEND_DONE,
+	URING_SEND_FAILED,
+};
+
+/* Plain TCP link whose receives and sends go through the shared ring */
+struct uring_link {
+	int				fd;
+	bool				active;
+
+	/* Owner's lock, guards what the completions touch */
+	pthread_mutex_t			*lock;
+	/* Called after completions for the link, from a reactor worker */
+	void				(*notify)(void *ctx);
+	void				*ctx;
+
+	uint32_t			ops;	/* Submitted and not completed */
+	struct uring_op			recv_op;
+	struct uring_op			send_op;
+	struct uring_op			cancel_op;
+
+	/* Received buffers by id in arrival order, owned until recycled */
+	bool				recv_armed;
+	bool				recv_closed;
+	int32_t				rx_first;
+	int32_t				rx_last;
+	uint32_t			rx_offset;
+
+	/* Send in progress, split into linked sendmsg chunks of UIO_MAXIOV */
+	struct iovec			*send_iov;
+	int				send_cnt;
+	bool				send_more;	/* MSG_MORE on the last chunk too */
+	struct msghdr			*msgs;
+	int				msgs_size;
+	uint32_t			send_pending;
+	uint64_t			send_bytes;
+	int				send_error;
+};
+
+bool uring_init(void);
+void uring_exit(void);
+
+bool uring_link_start(struct uring_link *ul, int fd, pthread_mutex_t *lock,
+		      void (*notify)(void *ctx), void *ctx);
+void uring_link_stop(struct uring_link *ul);
+bool uring_link_idle(struct uring_link *ul);
+void uring_link_release(struct uring_link *ul);
+
+int uring_recv(struct uring_link *ul, uint8_t *data, uint32_t len);
+bool uring_send(struct uring_link *ul, struct iovec *iov, int iovcnt, bool more);
+enum uring_send_state uring_send_poll(struct uring_link *ul);
+
+#endif /* __REMOTEHUB_SERVER_URING_H__ */
@@ -21,11 +21,17 @@
 #define __REMOTEHUB_SERVER_USB_H__
 
 #include <stdint.h>
+#include <time.h>
 #include <libusb-1.0/libusb.h>
 
 #include "remotehub.h"
 #include "network.h"
+#include "usbip.h"
 #include "event.h"
+#include "server.h"
+#include "pool.h"
+#include "reactor.h"
+#include "uring.h"
 
 /* See linux kernel ch9.h header for the USB related defines */
 
@@ -81,6 +87,30 @@
 #define USB_ENDPOINT_XFER_BULK		2
 #define USB_ENDPOINT_XFER_INT		3
 
+/*
+ * Mass storage, the UAS protocol runs on bulk streams
+ */
+#define USB_CLASS_MASS_STORAGE		0x08
+#define USB_SC_SCSI			0x06
+#define USB_PR_UAS			0x62
+#define USB_PR_BULK			0x50
+
+/*
+ * Bulk-only transport wrappers, and the SCSI commands read ahead
+ */
+#define BOT_CBW_LEN			31
+#define BOT_CBW_SIGNATURE		0x43425355
+#define BOT_CBW_FLAG_IN			0x80
+#define BOT_CSW_LEN			13
+#define BOT_RESET_REQUEST		0xff
+#define SCSI_READ_10			0x28
+#define SCSI_READ_16			0x88
+
+/*
+ * Device speeds, as in the kernel enum usb_device_speed
+ */
+#define USB_SPEED_SUPER			5
+
 /*
  * Port feature numbers
  * See USB 2.0 spec Table 11-17
@@ -127,35 +157,227 @@ struct usb_ctrlrequest {
 	uint16_t wLength;
 } __attribute__((packed));
 
+/* Keeps fields written from different threads on their own cache lines */
+#define CACHELINE_SIZE			64
+#define CACHELINE_ALIGNED		__attribute__((aligned(CACHELINE_SIZE)))
+
+/* Packets of one endpoint, USB_DIR_IN endpoints are at index 16 + number */
+struct ep_queue {
+	uint32_t			queued;
+	uint32_t			depth;
+	struct usb_packet		*backlog_head;
+	struct usb_packet		*backlog_tail;
+};
+
+#define EP_QUEUE_COUNT			32
+
+/* Part of the command being received */
+enum rx_state {
+	RX_HEADER,
+	RX_CREDIT,
+	RX_DATA,
+	RX_ISO,
+};
+
+/* Replies gathered for one write */
+struct tx_batch {
+	struct iovec			*iov;
+	int				iovcnt;
+	uint32_t			bytes;
+	struct usb_packet		*head;
+	struct usb_packet		*tail;
+
+	/* Unsent part while the socket is full */
+	bool				sending;
+	bool				more;		/* Sent with MSG_MORE */
+	struct iovec			*send_iov;
+	int				send_cnt;
+
+	/* Holds a reply that may not wait, MSG_MORE is then not used */
+	bool				urgent;
+
+	/* Coalescing window of the first gathered reply */
+	bool				deadline_set;
+	struct timespec			deadline;
+};
+
+/* Logged when forwarding stops, to see what coalescing and batching gained */
+struct forward_stats {
+	uint64_t			replies;
+	uint64_t			batches;
+	uint64_t			corked;		/* Batches sent with MSG_MORE */
+	uint64_t			tx_bytes;
+	uint64_t			rx_reads;	/* recv calls, or ring buffer copies */
+	uint64_t			rx_bytes;
+};
+
+#define PREFETCH_MAX_DEPTH		4
+#define STREAM_MAX_EPS			4
+#define STREAM_MAX_COUNT		256
+#define BOT_MAX_READAHEAD		(1024 * 1024)
+
+/* Interrupt IN reads kept submitted ahead of the client on one endpoint */
+struct int_prefetch {
+	uint32_t			length;		/* Of the reads, 0 when idle */
+	int				count;
+	struct usb_packet		*spec[PREFETCH_MAX_DEPTH];
+	struct usb_packet		*held_head;	/* Reports waiting for a read */
+	struct usb_packet		*held_tail;
+	struct usb_packet		*wait_head;	/* Reads waiting for a report */
+	struct usb_packet		*wait_tail;
+};
+
+enum bot_phase {
+	BOT_IDLE,
+	BOT_DATA,
+	BOT_STATUS,
+};
+
+/* Data and status of a mass storage READ, read as soon as its command is sent */
+struct bot_readahead {
+	uint8_t				in_ep;		/* 0 when there is no BOT */
+	uint8_t				out_ep;
+	bool				stale;		/* Client reset or gave up */
+	enum bot_phase			phase;
+	struct usb_packet		*data;
+	struct usb_packet		*csw;
+	uint32_t			taken;		/* Data already handed out */
+	struct usb_packet		*wait_head;	/* Reads waiting for the device */
+	struct usb_packet		*wait_tail;
+};
+
+/* Standard descriptor read at export time, answered without the device */
+struct desc_entry {
+	uint16_t			wValue;		/* Type and index */
+	uint16_t			wIndex;		/* Language of a string */
+	uint16_t			len;
+	struct desc_entry		*next;
+	uint8_t				data[];
+};
+
 struct forward_info {
 	struct est_conn			*link;
 	struct libusb_device		*libusb_dev;
+	/* The same device in the libusb context the export runs on */
+	struct libusb_device		*shard_dev;
+	int				shard;
 	struct libusb_device_handle	*handle;
 
-	bool				terminate;
-	bool				forwarding;
-	pthread_t			forwarding_thread;
+	bool				terminate;	/* Export is being torn down */
+	bool				forwarding;	/* Until reaped by forwarding_wait */
+	bool				cancelled;
+	bool				stopped;	/* Teardown finished */
+
+	/* Still opened and claimed after the export, until forwarding_cool */
+	bool				warm;
+	uint64_t			warm_until;	/* Monotonic seconds */
+	struct sockaddr_storage		warm_peer;	/* Client of the last export */
+
+	struct reactor_source		link_src;
+	struct reactor_source		wake_src;	/* eventfd, completions */
+	struct reactor_source		timer_src;	/* timerfd, TX coalescing */
+	struct uring_link		uring;		/* Replaces link_src when active */
 
-	uint32_t			packets_ready;
 	pthread_mutex_t			buffer_lock;
 	pthread_cond_t			buffer_cond;
-	uint32_t			buffer_size;
-	struct usb_packet		*buffer_head;
+
+	/* Written by the libusb workers on each completion, newest first */
+	struct usb_packet		*completed CACHELINE_ALIGNED;
+	uint32_t			packets_inflight;
+
+	/* Pending handler runs, raised by each wakeup of the device */
+	uint32_t			work CACHELINE_ALIGNED;
+	/* The handler gave up its worker with work held, the next kick resumes it */
+	bool				yielded;
+
+	/* The rest belongs to the handler */
+
+	/* Credits taken by the packets between reception and reply */
+	struct flow_budget		budget CACHELINE_ALIGNED;
+	struct tx_coalesce_policy	coalesce;
+	uint64_t			bytes_queued;
+	uint32_t			urbs_queued;
+	uint32_t			packets_backlogged;
+
+	/* Submitted packets by seqnum until TX has sent them back */
+	struct usb_packet		**inflight;
+	uint32_t			inflight_mask;
+	/* Completed packets in completion order */
+	struct usb_packet		*ready_head;
+	struct usb_packet		*ready_tail;
+	/* Submitted or waiting for room, until sent back */
+	struct ep_queue			ep[EP_QUEUE_COUNT];
+
+	struct packet_pool		pool;
+	struct forward_stats		stats;
+
+	/* Until the device is reset or configured by the client */
+	struct desc_entry		*desc_cache;
+
+	/* By interrupt IN endpoint number */
+	struct int_prefetch		prefetch[16];
+
+	/* Bulk endpoints with streams, of the UAS altsetting in use */
+	uint8_t				stream_eps[STREAM_MAX_EPS];
+	int				stream_ep_count;
+	uint32_t			streams;
+
+	struct bot_readahead		bot;
+
+	/* Received but not yet parsed command data */
+	uint8_t				*rx_buf;
+	uint32_t			rx_head;
+	uint32_t			rx_tail;
+
+	enum rx_state			rx_state;
+	uint32_t			rx_got;
+	struct usbip_header		rx_hdr;
+	struct usb_packet		*rx_packet;
+
+	struct tx_batch			tx;
 };
 
 struct server_usb_device {
 	struct usb_device_info		info;
 	struct forward_info		fwd;
 	struct server_usb_device	*next;
+	struct server_usb_device	*prev;
+	struct server_usb_device	*hnext;		/* Busid table chain */
+	uint64_t			generation;	/* Of the last change */
+	bool				importing;	/* Owned by an import worker */
+	bool				detached;	/* Removed once the import is done */
 };
 
-#define PACKET_BUF_SIZE			32
+#define EP_DEPTH_CONTROL		8
+#define EP_DEPTH_ISOC			32
+#define EP_DEPTH_BULK			64
+#define EP_DEPTH_INT			8
+#define INFLIGHT_TABLE_MIN		64	/* Buckets, grown to twice the URB limit */
+#define INFLIGHT_TABLE_MAX		65536
+#define RX_BUFFER_SIZE			(64 * 1024)
+#define RX_DIRECT_THRESHOLD		(16 * 1024)
 #define MAX_BUSID_LEN			32
+#define USB_DEVICE_TABLE_SIZE		256	/* Must be a power of two */
+#define FORWARD_RUN_ROUNDS		16	/* Before yielding the worker */
+#define USB_RESCAN_INTERVAL		30	/* Seconds, fallback to hotplug */
+#define DEVLIST_REMOVAL_HISTORY		64
+#define DESC_CACHE_MAX_LEN		4096	/* Longer descriptors go to the device */
+#define DESC_CACHE_TIMEOUT_MS		1000
+#define DESC_CACHE_MAX_CONFIGS		8
+
+#define FLOW_USB2_BYTE_BUDGET		(4 * 1024 * 1024)
+#define FLOW_USB2_URB_LIMIT		64
+#define FLOW_USB3_BYTE_BUDGET		(32 * 1024 * 1024)
+#define FLOW_USB3_URB_LIMIT		256
 
-bool usb_task_init(void);
+bool usb_task_init(struct server_info info);
 void usb_exit(void);
 
 bool usb_disable_bus(int busnum);
+void forwarding_init(struct server_info info, libusb_context **shards, int shard_count);
 bool forwarding_start(struct server_usb_device *dev);
+void forwarding_stop(struct server_usb_device *dev);
+void forwarding_wait(struct server_usb_device *dev);
+void forwarding_cool(struct server_usb_device *dev, bool now);
 
 #endif /* __REMOTEHUB_SERVER_HOST_H__*/
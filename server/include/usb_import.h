@@ -0,0 +1,41 @@
+/*
+ * Copyright (C) 2021 Jani Laitinen
+ *
+ * This file is part of RemoteHub.
+ *
+ * RemoteHub is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * RemoteHub is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with RemoteHub.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __REMOTEHUB_SERVER_USB_IMPORT_H__
+#define __REMOTEHUB_SERVER_USB_IMPORT_H__
+
+#include <stdbool.h>
+
+#include "network.h"
+
+#define USB_IMPORT_WORKERS		4
+
+struct server_usb_device;
+
+/* Posted as EVENT_USB_IMPORTED when the device is no longer being imported */
+struct usb_import {
+	struct server_usb_device	*device;
+	bool				ok;
+};
+
+bool usb_import_init(void);
+void usb_import_exit(void);
+bool usb_import_request(struct server_usb_device *device, struct est_conn *link);
+
+#endif /* __REMOTEHUB_SERVER_USB_IMPORT_H__ */
@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2021 Jani Laitinen
+ *
+ * This file is part of RemoteHub.
+ *
+ * RemoteHub is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * RemoteHub is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with RemoteHub.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __REMOTEHUB_SERVER_USB_STRINGS_H__
+#define __REMOTEHUB_SERVER_USB_STRINGS_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <libusb-1.0/libusb.h>
+
+#include "remotehub.h"
+
+#define USB_STRINGS_WORKERS		4
+#define USB_STRINGS_TIMEOUT_MS		500	/* Per control transfer */
+
+/* Holds a reference to the device until the USB task has taken it */
+struct usb_strings {
+	struct usb_strings		*next;
+	struct libusb_device		*dev;
+	struct libusb_device_descriptor	desc;
+	bool				opened;
+	char				manufacturer_name[RH_DEVICE_NAME_MAX_LEN];
+	char				product_name[RH_DEVICE_NAME_MAX_LEN];
+};
+
+bool usb_strings_init(void);
+void usb_strings_exit(void);
+bool usb_strings_request(struct libusb_device *dev, struct libusb_device_descriptor *desc);
+struct usb_strings *usb_strings_take(void);
+
+#endif /* __REMOTEHUB_SERVER_USB_STRINGS_H__ */
@@ -26,15 +26,51 @@
 #include "server.h"
 #include "srv_event.h"
 #include "usbip.h"
+#include "host.h"
+
+/*
+ * The accepting thread only accepts. The TLS handshake and the op header
+ * are handled by a few workers with a deadline each, so a slow or stalled
+ * client does not hold up the others. With HOST_PENDING_MAX connections
+ * waiting the thread stops accepting, further clients wait in the listen
+ * backlog of the kernel instead of being closed.
+ */
+
+struct pending_conn {
+	struct est_conn		*link;
+	struct pending_conn	*next;
+};
 
 static struct rh_task host_rx;
 static struct server_conn conn;
 static pthread_t server_rx_thread;
 static bool server_started;
 
+static pthread_t workers[HOST_HANDSHAKE_WORKERS];
+static int worker_count;
+static pthread_mutex_t pending_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pending_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t room_cond = PTHREAD_COND_INITIALIZER;
+static struct pending_conn *pending_head;
+static struct pending_conn *pending_tail;
+static int pending_count;
+
+/* Answered from the published snapshot, the USB task is only needed before the first one */
 static void handle_usbip_op_devlist(struct est_conn *link)
 {
 	struct rh_event event = {0};
+	struct rh_devicelist *list;
+
+	list = rh_devicelist_get();
+	if (list) {
+		if (!network_send_data(link, list->wire, list->wire_len))
+			rh_trace(LVL_ERR, "Failed to send devlist\n");
+
+		rh_devicelist_put(list);
+		network_close_link(link);
+		free(link);
+		return;
+	}
 
 	event.type = EVENT_REQ_DEVICELIST;
 	event.link = link;
@@ -47,10 +83,20 @@ static void handle_usbip_op_devlist(struct est_conn *link)
 
 static void handle_usbip_op_import(struct est_conn *link)
 {
+	struct usbip_op_import_request import_req;
 	struct rh_event event = {0};
 
+	if (!network_recv_data(link, (uint8_t *)&import_req, sizeof(import_req))) {
+		rh_trace(LVL_ERR, "Failed to receive data\n");
+		network_close_link(link);
+		free(link);
+		return;
+	}
+
 	event.type = EVENT_REQ_IMPORT;
 	event.link = link;
+	event.data = &import_req;
+	event.size = sizeof(import_req);
 
 	if (!event_enqueue(&event)) {
 		network_close_link(link);
@@ -61,6 +107,18 @@ static void handle_usbip_op_import(struct est_conn *link)
 static void handle_usbip_command(struct est_conn *link)
 {
 	struct usbip_op_common hdr;
+	int fd;
+
+	if (!network_handshake(&conn, link, HOST_HANDSHAKE_TIMEOUT_MS)) {
+		network_close_link(link);
+		free(link);
+		return;
+	}
+
+	/* Bounds the requests too, cleared when an export starts */
+	fd = network_link_fd(link);
+	network_send_timeout_seconds_set(fd, HOST_HANDSHAKE_TIMEOUT_MS / 1000);
+	network_recv_timeout_seconds_set(fd, HOST_HANDSHAKE_TIMEOUT_MS / 1000);
 
 	if (!usbip_net_recv_usbip_header(link, &hdr)) {
 		rh_trace(LVL_ERR, "Failed to receive usbip header\n");
@@ -86,26 +144,100 @@ static void handle_usbip_command(struct est_conn *link)
 	}
 }
 
+static void *handshake_worker(void *args)
+{
+	struct pending_conn *pending;
+
+	(void) args;
+
+	while (true) {
+		pthread_mutex_lock(&pending_lock);
+		while (host_rx.running && !pending_head)
+			pthread_cond_wait(&pending_cond, &pending_lock);
+
+		if (!host_rx.running) {
+			pthread_mutex_unlock(&pending_lock);
+			break;
+		}
+
+		pending = pending_head;
+		pending_head = pending->next;
+		if (!pending_head)
+			pending_tail = NULL;
+		if (pending_count-- == HOST_PENDING_MAX)
+			pthread_cond_signal(&room_cond);
+		pthread_mutex_unlock(&pending_lock);
+
+		handle_usbip_command(pending->link);
+		free(pending);
+	}
+
+	return NULL;
+}
+
+/* Returns false when the host is stopping */
+static bool wait_for_room(void)
+{
+	bool running;
+
+	pthread_mutex_lock(&pending_lock);
+	if (host_rx.running && pending_count >= HOST_PENDING_MAX)
+		rh_trace(LVL_DBG, "Handshake queue full, accepting paused\n");
+
+	while (host_rx.running && pending_count >= HOST_PENDING_MAX)
+		pthread_cond_wait(&room_cond, &pending_lock);
+	running = host_rx.running;
+	pthread_mutex_unlock(&pending_lock);
+
+	return running;
+}
+
+/* Only the accepting thread queues, wait_for_room has made space for it */
+static void queue_connection(struct est_conn *link)
+{
+	struct pending_conn *pending;
+
+	pending = calloc(1, sizeof(struct pending_conn));
+	if (!pending) {
+		rh_trace(LVL_ERR, "Out of memory\n");
+		network_close_link(link);
+		free(link);
+		return;
+	}
+	pending->link = link;
+
+	pthread_mutex_lock(&pending_lock);
+	if (!pending_tail)
+		pending_head = pending;
+	else
+		pending_tail->next = pending;
+	pending_tail = pending;
+	pending_count++;
+	pthread_cond_signal(&pending_cond);
+	pthread_mutex_unlock(&pending_lock);
+}
+
 static void *usbip_rx_handler(void *args)
 {
 	struct est_conn *link = NULL;
 
 	(void) args;
 
-	while (host_rx.running) {
+	while (wait_for_room()) {
 		link = calloc(1, sizeof(struct est_conn));
 		if (!link) {
 			rh_trace(LVL_ERR, "Out of memory\n");
 			continue;
 		}
 
-		if (!network_listen(&conn, link)) {
-			rh_trace(LVL_ERR, "Network listen failed\n");
+		if (!network_accept(&conn, link)) {
+			if (host_rx.running)
+				rh_trace(LVL_ERR, "Network accept failed\n");
 			free(link);
 			usleep(100000);
 			continue;
 		}
-		handle_usbip_command(link);
+		queue_connection(link);
 	}
 
 	rh_trace(LVL_TRC, "Host exit\n");
@@ -113,6 +245,31 @@ static void *usbip_rx_handler(void *args)
 	return NULL;
 }
 
+static void stop_workers(void)
+{
+	struct pending_conn *pending;
+
+	pthread_mutex_lock(&pending_lock);
+	host_rx.running = false;
+	pthread_cond_broadcast(&pending_cond);
+	pthread_cond_broadcast(&room_cond);
+	pthread_mutex_unlock(&pending_lock);
+
+	for (int i = 0; i < worker_count; i++)
+		pthread_join(workers[i], NULL);
+	worker_count = 0;
+
+	while (pending_head) {
+		pending = pending_head;
+		pending_head = pending->next;
+		network_close_link(pending->link);
+		free(pending->link);
+		free(pending);
+	}
+	pending_tail = NULL;
+	pending_count = 0;
+}
+
 void host_exit(void)
 {
 	rh_trace(LVL_TRC, "Host network terminate\n");
@@ -126,10 +283,15 @@ void host_exit(void)
 		}
 	}
 
+	/* The accepting thread may be waiting for room in the queue */
+	pthread_mutex_lock(&pending_lock);
 	host_rx.running = false;
+	pthread_cond_broadcast(&room_cond);
+	pthread_mutex_unlock(&pending_lock);
 	pthread_cond_signal(&host_rx.event_cond);
 	if (server_rx_thread)
 		pthread_join(server_rx_thread, NULL);
+	stop_workers();
 	if (server_started) {
 		if (conn.encryption)
 			network_exit_server_tls(&conn);
@@ -158,8 +320,17 @@ bool host_task_init(struct server_info info)
 	strcpy(host_rx.task_name, "Host network task");
 	event_task_register(&host_rx);
 
+	for (worker_count = 0; worker_count < HOST_HANDSHAKE_WORKERS; worker_count++) {
+		if (pthread_create(&workers[worker_count], NULL, handshake_worker, NULL)) {
+			rh_trace(LVL_ERR, "Failed to start handshake worker\n");
+			stop_workers();
+			return false;
+		}
+	}
+
 	if (pthread_create(&server_rx_thread, NULL, usbip_rx_handler, NULL)) {
 		rh_trace(LVL_ERR, "Failed to start rx thread\n");
+		stop_workers();
 		return false;
 	}
 
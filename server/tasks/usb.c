@@ -18,6 +18,9 @@
  */
 
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
 
 #include <libusb-1.0/libusb.h>
 
@@ -29,20 +32,60 @@
 #include "server.h"
 #include "usbip.h"
 #include "usb.h"
+#include "reactor.h"
+#include "uring.h"
+#include "usb_strings.h"
+#include "usb_import.h"
 
 struct usb_bus_info {
 	int bus;
 	struct usb_bus_info *next;
 };
 
-static pthread_t libusb_thread, usb_thread;
+static pthread_t usb_thread;
 static pthread_mutex_t usb_conf_lock;
-static bool libusb_running = true;
+static bool reactor_running;
 
 static libusb_context *usb_context;
+/* Exports are spread over these, the first one is usb_context */
+static libusb_context *usb_shards[REACTOR_MAX_USB_CONTEXTS];
+static int usb_shard_count;
 static struct server_usb_device *usb_head;
 static struct usb_bus_info *usb_bus_info_head;
 
+/* Devices by busid, and what was read from the devices seen on each port */
+struct usb_desc_cache {
+	uint16_t			idVendor;
+	uint16_t			idProduct;
+	uint16_t			bcdDevice;
+	uint8_t				iSerialNumber;
+	struct usb_device_info		info;
+	struct usb_desc_cache		*next;
+};
+
+static struct server_usb_device *device_table[USB_DEVICE_TABLE_SIZE];
+static struct usb_desc_cache *desc_cache[USB_DEVICE_TABLE_SIZE];
+
+/* Raised on each change of the device list, snapshots are made on demand */
+static uint64_t devlist_generation = 1;
+static uint64_t published_generation;
+static struct timespec start_time;	/* Publish times are logged against it */
+static struct rh_devicelist *devlist_snapshot;
+static pthread_mutex_t snapshot_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct rh_devicelist_removal removals[DEVLIST_REMOVAL_HISTORY];
+static int removal_next;
+static int removal_count;
+
+/* With hotplug the full rescan is only a fallback for missed events */
+static bool hotplug_registered;
+static libusb_hotplug_callback_handle hotplug_handle;
+static uint32_t rescan_ticks;
+
+struct usb_hotplug {
+	struct libusb_device		*dev;
+	bool				arrived;
+};
+
 static struct rh_task usb;
 
 #define for_each_device(dev) \
@@ -50,53 +93,177 @@ static struct rh_task usb;
 	for (dev = usb_head; next = dev != NULL ? dev->next : NULL, \
 	     dev != NULL; dev = next)
 
-static bool device_already_exists(char *id)
+static bool get_busid(struct libusb_device *dev, char *dest, int max_len)
 {
-	struct server_usb_device *tmp;
+	uint8_t port_numbers[32];
+	int len, ret;
 
-	for_each_device(tmp) {
-		if (!strcmp(tmp->info.udev.busid, id))
-			return true;
+	ret = libusb_get_port_numbers(dev, port_numbers, sizeof(port_numbers));
+	if (ret <= 0) {
+		rh_trace(LVL_ERR, "Busid read failed %d\n", ret);
+		return false;
 	}
 
-	return false;
+	len = snprintf(dest, max_len, "%d-", libusb_get_bus_number(dev));
+	for (int i = 0; i < ret && len < max_len; i++)
+		len += snprintf(&dest[len], max_len - len, i < ret - 1 ? "%d." : "%d",
+				port_numbers[i]);
+
+	return len < max_len;
 }
 
-static void insert_device(struct server_usb_device *device)
+/* FNV-1a */
+static uint32_t busid_hash(const char *busid)
 {
-	if (usb_head == NULL) {
-		usb_head = device;
-		return;
+	uint32_t hash = 2166136261u;
+
+	while (*busid) {
+		hash ^= (uint8_t)*busid++;
+		hash *= 16777619u;
 	}
+
+	return hash & (USB_DEVICE_TABLE_SIZE - 1);
+}
+
+static struct server_usb_device *lookup_device(const char *busid)
+{
+	struct server_usb_device *tmp = device_table[busid_hash(busid)];
+
+	while (tmp && strcmp(tmp->info.udev.busid, busid))
+		tmp = tmp->hnext;
+
+	return tmp;
+}
+
+/* libusb keeps one device object per attached device, so it can be matched by pointer */
+static struct server_usb_device *find_device(struct libusb_device *dev)
+{
+	struct server_usb_device *tmp;
+	char busid[MAX_BUSID_LEN];
+
+	if (!get_busid(dev, busid, MAX_BUSID_LEN))
+		return NULL;
+
+	tmp = lookup_device(busid);
+	if (tmp && tmp->fwd.libusb_dev != dev)
+		return NULL;
+
+	return tmp;
+}
+
+static void insert_device(struct server_usb_device *device)
+{
+	struct server_usb_device **bucket = &device_table[busid_hash(device->info.udev.busid)];
+
+	device->prev = NULL;
 	device->next = usb_head;
+	if (usb_head)
+		usb_head->prev = device;
 	usb_head = device;
+
+	device->hnext = *bucket;
+	*bucket = device;
 }
 
 static void delete_device(struct server_usb_device *device)
 {
-	struct server_usb_device *tmp;
+	struct server_usb_device **tmp = &device_table[busid_hash(device->info.udev.busid)];
+
+	while (*tmp && *tmp != device)
+		tmp = &(*tmp)->hnext;
+	if (*tmp)
+		*tmp = device->hnext;
+
+	if (device->prev)
+		device->prev->next = device->next;
+	else
+		usb_head = device->next;
+	if (device->next)
+		device->next->prev = device->prev;
+
+	rh_trace(LVL_DBG, "Deleting %s\n", device->info.product_name);
+	free(device);
+}
 
-	if (usb_head == NULL) {
-		rh_trace(LVL_ERR, "Usb head was null\n");
-		return;
-	}
+static void devlist_changed(struct server_usb_device *device)
+{
+	device->generation = ++devlist_generation;
+}
 
-	if (!strcmp(usb_head->info.udev.busid, device->info.udev.busid)) {
-		usb_head = usb_head->next;
-		rh_trace(LVL_DBG, "Deleting device at head %s\n", device->info.product_name);
-		free(device);
-		return;
-	}
+static void devlist_removed(struct server_usb_device *device)
+{
+	struct rh_devicelist_removal *removal = &removals[removal_next];
+
+	removal->generation = ++devlist_generation;
+	memcpy(removal->busid, device->info.udev.busid, USBIP_BUSID_SIZE);
+
+	removal_next = (removal_next + 1) % DEVLIST_REMOVAL_HISTORY;
+	if (removal_count < DEVLIST_REMOVAL_HISTORY)
+		removal_count++;
+}
+
+/*
+ * What was read from a device is kept per port, so that a device plugged
+ * back in is not opened again for its strings. A different device on the
+ * port replaces the entry.
+ */
+static bool desc_cache_match(struct usb_desc_cache *entry, const char *busid,
+			     struct libusb_device_descriptor *desc)
+{
+	return !strcmp(entry->info.udev.busid, busid) &&
+	       entry->idVendor == desc->idVendor && entry->idProduct == desc->idProduct &&
+	       entry->bcdDevice == desc->bcdDevice &&
+	       entry->iSerialNumber == desc->iSerialNumber;
+}
+
+static struct usb_desc_cache *desc_cache_lookup(const char *busid,
+						struct libusb_device_descriptor *desc)
+{
+	struct usb_desc_cache *entry = desc_cache[busid_hash(busid)];
+
+	while (entry && strcmp(entry->info.udev.busid, busid))
+		entry = entry->next;
+
+	if (entry && !desc_cache_match(entry, busid, desc))
+		return NULL;
+
+	return entry;
+}
 
-	tmp = usb_head;
-	while (tmp->next) {
-		if (!strcmp(tmp->next->info.udev.busid, device->info.udev.busid)) {
-			tmp->next = device->next;
-			rh_trace(LVL_DBG, "Deleting %s\n", device->info.product_name);
-			free(device);
+static void desc_cache_store(struct usb_device_info *info, struct libusb_device_descriptor *desc)
+{
+	struct usb_desc_cache **bucket = &desc_cache[busid_hash(info->udev.busid)];
+	struct usb_desc_cache *entry = *bucket;
+
+	while (entry && strcmp(entry->info.udev.busid, info->udev.busid))
+		entry = entry->next;
+
+	if (!entry) {
+		entry = calloc(1, sizeof(struct usb_desc_cache));
+		if (!entry)
 			return;
+		entry->next = *bucket;
+		*bucket = entry;
+	}
+
+	entry->idVendor = desc->idVendor;
+	entry->idProduct = desc->idProduct;
+	entry->bcdDevice = desc->bcdDevice;
+	entry->iSerialNumber = desc->iSerialNumber;
+	entry->info = *info;
+	entry->info.exported = 0;
+}
+
+static void desc_cache_clear(void)
+{
+	struct usb_desc_cache *entry;
+
+	for (int i = 0; i < USB_DEVICE_TABLE_SIZE; i++) {
+		while (desc_cache[i]) {
+			entry = desc_cache[i];
+			desc_cache[i] = entry->next;
+			free(entry);
 		}
-		tmp = tmp->next;
 	}
 }
 
@@ -203,37 +370,6 @@ static void inform_detached(struct usbip_usb_device dev)
 	(void) event_enqueue(&event);
 }
 
-static bool get_busid(struct libusb_device *dev, char *dest, int max_len)
-{
-	char port_numbers[32] = {0}, tmp[32] = {0};
-	int len, ret;
-
-	memset(dest, 0, max_len);
-
-	len = sprintf(tmp, "%d-", libusb_get_bus_number(dev));
-
-	strcat(dest, tmp);
-	ret = libusb_get_port_numbers(dev, (uint8_t *)&port_numbers, 32);
-	if (ret == LIBUSB_ERROR_OVERFLOW) {
-		rh_trace(LVL_ERR, "Busid read failed %d\n", ret);
-		return false;
-	}
-
-	for (int i = 0; i < ret - 1; i++) {
-		len += sprintf(tmp, "%d.", port_numbers[i]);
-		if (len >= max_len)
-			return false;
-		strcat(dest, tmp);
-	}
-
-	len += sprintf(tmp, "%d", port_numbers[ret - 1]);
-	if (len >= max_len)
-		return false;
-	strcat(dest, tmp);
-
-	return true;
-}
-
 static void parse_endpoints(struct usb_device_info *info, struct libusb_interface_descriptor intf)
 {
 	for (int i = 0; i < intf.bNumEndpoints; i++) {
@@ -258,10 +394,10 @@ static bool get_basic_device_info(struct server_usb_device *device, struct libus
 {
 	int ret;
 	bool ok;
-	libusb_device_handle *temp_handle;
 	struct libusb_config_descriptor *cfg;
 	struct libusb_device_descriptor dev_desc;
 	struct usb_device_info info = {0};
+	struct usb_desc_cache *cached;
 
 	info.udev.busnum = libusb_get_bus_number(dev);
 	info.udev.devnum = libusb_get_port_number(dev);
@@ -291,6 +427,14 @@ static bool get_basic_device_info(struct server_usb_device *device, struct libus
 	if (!ok)
 		return false;
 
+	cached = desc_cache_lookup(info.udev.busid, &dev_desc);
+	if (cached) {
+		rh_trace(LVL_DBG, "Device %s seen before on the port\n", info.udev.busid);
+		device->info = cached->info;
+		device->info.udev.speed = info.udev.speed;
+		return true;
+	}
+
 	/* Devices with one config are only supported */
 	ret = libusb_get_config_descriptor(dev, 0, &cfg);
 	if (ret != 0)
@@ -324,90 +468,68 @@ static bool get_basic_device_info(struct server_usb_device *device, struct libus
 
 	libusb_free_config_descriptor(cfg);
 
-	ret = libusb_open(dev, &temp_handle);
-	if (ret < 0) {
-		rh_trace(LVL_DBG, "Failed to open device %d, %s - %s\n",
-			 ret,
-			 libusb_error_name(ret),
-			 libusb_strerror(ret));
-		return false;
-	}
+	/* Named by its ids until the strings have been read */
+	snprintf(info.udev.path, 256, "%04x:%04x", info.udev.idVendor, info.udev.idProduct);
 
-	ret = libusb_get_string_descriptor_ascii(temp_handle, dev_desc.iManufacturer,
-						 (uint8_t *)info.manufacturer_name,
-						 RH_DEVICE_NAME_MAX_LEN);
-	if (ret < 0) {
-		rh_trace(LVL_DBG, "Device string 1 query failed: %d, %s - %s\n",
-			 ret, libusb_error_name(ret), libusb_strerror(ret));
-		memset(info.manufacturer_name, 0x00, RH_DEVICE_NAME_MAX_LEN);
-	}
-
-	ret = libusb_get_string_descriptor_ascii(temp_handle, dev_desc.iProduct,
-						 (uint8_t *)info.product_name,
-						 RH_DEVICE_NAME_MAX_LEN);
-	if (ret < 0) {
-		rh_trace(LVL_DBG, "Device string 2 query failed: %d, %s - %s\n",
-			 ret, libusb_error_name(ret), libusb_strerror(ret));
-		memset(info.product_name, 0x00, RH_DEVICE_NAME_MAX_LEN);
-	}
-
-	libusb_close(temp_handle);
-
-	/* Put device name into path variable instead of the path itself */
-	snprintf(info.udev.path, 256, "%s - %s", info.manufacturer_name, info.product_name);
+	if (!usb_strings_request(dev, &dev_desc))
+		return false;
 
 	device->info = info;
 
 	return true;
 }
 
-static bool add_new_devices(libusb_device **devs)
+/* Returns false only when out of memory */
+static bool add_device(struct libusb_device *dev)
 {
-	int i = 0;
-	bool ok;
-	char busid[MAX_BUSID_LEN];
-	struct libusb_device *dev;
 	struct libusb_device_descriptor desc;
 	struct server_usb_device *device_entry;
 
-	while (dev = devs[i++], dev != NULL) {
+	if (libusb_get_device_descriptor(dev, &desc))
+		return true;
 
-		if (libusb_get_device_descriptor(dev, &desc))
-			continue;
+	/* We are not interested in usb hubs now */
+	if (desc.bDeviceClass == 0x09)
+		return true;
 
-		/* We are not interested in usb hubs now */
-		if (desc.bDeviceClass == 0x09)
-			continue;
+	if (find_device(dev))
+		return true;
 
-		ok = get_busid(dev, busid, MAX_BUSID_LEN);
-		if (!ok)
-			continue;
+	// TODO: Disable individual ports
 
-		if (device_already_exists(busid)) {
-			rh_trace(LVL_TRC, "Device %s already exists\n", busid);
-			continue;
-		}
+	if (bus_is_disabled(libusb_get_bus_number(dev)))
+		return true;
 
-		// TODO: Disable individual ports
+	/* The forwarding state has cache line aligned parts */
+	if (posix_memalign((void **)&device_entry, CACHELINE_SIZE,
+			   sizeof(struct server_usb_device)))
+		return false;
+	memset(device_entry, 0, sizeof(struct server_usb_device));
 
-		if (bus_is_disabled(libusb_get_bus_number(dev)))
-			continue;
+	if (!get_basic_device_info(device_entry, dev)) {
+		free(device_entry);
+		return true;
+	}
 
-		device_entry = calloc(1, sizeof(struct server_usb_device));
-		if (!device_entry)
-			return false;
+	libusb_ref_device(dev);
+	device_entry->fwd.libusb_dev = dev;
 
-		if (!get_basic_device_info(device_entry, dev)) {
-			free(device_entry);
-			continue;
-		}
+	rh_trace(LVL_DBG, "Inserting new device %s\n", device_entry->info.product_name);
+	insert_device(device_entry);
+	devlist_changed(device_entry);
+	inform_attached(device_entry->info.udev);
 
-		libusb_ref_device(dev);
-		device_entry->fwd.libusb_dev = dev;
+	return true;
+}
 
-		rh_trace(LVL_DBG, "Inserting new device %s\n", device_entry->info.product_name);
-		insert_device(device_entry);
-		inform_attached(device_entry->info.udev);
+static bool add_new_devices(libusb_device **devs)
+{
+	int i = 0;
+	struct libusb_device *dev;
+
+	while (dev = devs[i++], dev != NULL) {
+		if (!add_device(dev))
+			return false;
 	}
 
 	return true;
@@ -415,69 +537,66 @@ static bool add_new_devices(libusb_device **devs)
 
 static void terminate_forward(struct server_usb_device *device)
 {
-	if (device->fwd.link)
-		network_shut_link(device->fwd.link);
+	forwarding_stop(device);
+	forwarding_wait(device);
+	forwarding_cool(device, true);
+}
+
+static void remove_device(struct server_usb_device *device)
+{
+	if (device->importing) {
+		device->detached = true;
+		return;
+	}
 
-	if (device->fwd.forwarding_thread)
-		pthread_join(device->fwd.forwarding_thread, NULL);
-	device->fwd.forwarding_thread = 0;
+	rh_trace(LVL_DBG, "Deleting %s\n", device->info.manufacturer_name);
+	devlist_removed(device);
+	terminate_forward(device);
+	libusb_unref_device(device->fwd.libusb_dev);
+	inform_detached(device->info.udev);
+	delete_device(device);
+	rh_trace(LVL_DBG, "Deleted\n");
 }
 
-static bool remove_detached_devices(libusb_device **devs)
+/* Reaps the exports that have terminated and refreshes the exported flags */
+static void update_exports(void)
 {
-	int i = 0;
-	char busid[MAX_BUSID_LEN] = {0};
-	struct libusb_device *dev;
-	struct libusb_device_descriptor desc;
 	struct server_usb_device *device;
-	bool device_found, ok;
 
 	for_each_device(device) {
-		i = 0;
-		device_found = false;
-
-		if (device->fwd.terminate) {
-			if (device->fwd.forwarding_thread)
-				pthread_join(device->fwd.forwarding_thread, NULL);
-			device->fwd.forwarding_thread = 0;
-			device->fwd.terminate = false;
-		}
+		if (device->importing)
+			continue;
 
-		if (device->fwd.forwarding_thread)
-			device->info.exported = true;
-		else
-			device->info.exported = false;
+		if (device->fwd.terminate)
+			forwarding_wait(device);
+		forwarding_cool(device, false);
 
-		while (dev = devs[i++], dev != NULL) {
+		if (device->info.exported == device->fwd.forwarding)
+			continue;
 
-			if (libusb_get_device_descriptor(dev, &desc))
-				continue;
+		device->info.exported = device->fwd.forwarding;
+		devlist_changed(device);
+	}
+}
 
-			/* We are not interested in usb hubs now */
-			if (desc.bDeviceClass == 0x09)
-				continue;
+static bool remove_detached_devices(libusb_device **devs)
+{
+	int i;
+	struct server_usb_device *device;
+	bool device_found;
 
-			ok = get_busid(dev, busid, MAX_BUSID_LEN);
-			if (!ok) {
-				rh_trace(LVL_CRIT, "Can not remove device (%s)\n", busid);
-				continue;
-			}
+	for_each_device(device) {
+		device_found = false;
 
-			if (!strcmp(device->info.udev.busid, busid)) {
+		for (i = 0; devs[i]; i++) {
+			if (devs[i] == device->fwd.libusb_dev) {
 				device_found = true;
 				break;
 			}
 		}
 
-		if (!device_found) {
-			rh_trace(LVL_DBG, "Deleting %s\n", device->info.manufacturer_name);
-			terminate_forward(device);
-			libusb_unref_device(device->fwd.libusb_dev);
-			inform_detached(device->info.udev);
-			delete_device(device);
-			rh_trace(LVL_DBG, "Deleted\n");
-			continue;
-		}
+		if (!device_found)
+			remove_device(device);
 	}
 
 	return true;
@@ -612,33 +731,25 @@ static void handle_usbip_req_devicelist(struct rh_event *ev)
 	free(list);
 }
 
+/* Returns true when the link was handed to an import worker */
 static bool handle_usbip_req_import(struct rh_event *ev)
 {
+	struct usbip_op_import_request *import_req = ev->data;
 	struct server_usb_device *dev;
-	struct usbip_op_import_request import_req = {0};
-	struct usbip_op_import_reply import_rep = {0};
 	struct usbip_op_common hdr = {0};
-	bool ok, found = false;
-
-	if (!network_recv_data(ev->link, (uint8_t *)&import_req, sizeof(import_req))) {
-		rh_trace(LVL_ERR, "Failed to receive data\n");
-		return false;
-	}
 
 	hdr.version = USBIP_DEFAULT_PROTOCOL_VERSION;
 	hdr.code = USBIP_OP_REP_IMPORT;
 	hdr.status = USBIP_ST_OK;
 
-	for_each_device(dev) {
-		rh_trace(LVL_TRC, "Checking %s and %s\n", dev->info.udev.busid, import_req.busid);
-		if (!strcmp(dev->info.udev.busid, import_req.busid)) {
-			rh_trace(LVL_DBG, "Device %s found\n", dev->info.product_name);
-			found = true;
-			break;
-		}
+	if (!import_req || ev->size != sizeof(*import_req)) {
+		rh_trace(LVL_ERR, "Import request missing\n");
+		return false;
 	}
 
-	if (!found) {
+	import_req->busid[USBIP_BUSID_SIZE - 1] = '\0';
+	dev = lookup_device(import_req->busid);
+	if (!dev || dev->detached) {
 		hdr.status = USBIP_ST_NODEV;
 		if (!usbip_net_send_usbip_header(ev->link, &hdr))
 			rh_trace(LVL_ERR, "Failed to send USBIP header\n");
@@ -655,7 +766,11 @@ static bool handle_usbip_req_import(struct rh_event *ev)
 		return false;
 	}
 
-	if (dev->fwd.forwarding_thread) {
+	/* The client may be back before the stop of its last export got here */
+	if (dev->fwd.forwarding && dev->fwd.terminate && !dev->importing)
+		forwarding_wait(dev);
+
+	if (dev->importing || dev->fwd.forwarding) {
 		rh_trace(LVL_ERR, "Already exported\n");
 		hdr.status = USBIP_ST_DEV_BUSY;
 		if (!usbip_net_send_usbip_header(ev->link, &hdr))
@@ -663,46 +778,321 @@ static bool handle_usbip_req_import(struct rh_event *ev)
 		return false;
 	}
 
-	if (!usbip_net_send_usbip_header(ev->link, &hdr)) {
-		rh_trace(LVL_ERR, "Failed to send USBIP header\n");
+	dev->importing = true;
+	if (!usb_import_request(dev, ev->link)) {
+		dev->importing = false;
 		return false;
 	}
 
-	import_rep.udev = dev->info.udev;
+	return true;
+}
+
+static void handle_imported(struct usb_import *import)
+{
+	struct server_usb_device *device = import->device;
 
-	usbip_net_import_reply_to_network_order(&import_rep);
-	if (!network_send_data(ev->link, (uint8_t *)&import_rep, sizeof(import_rep))) {
-		rh_trace(LVL_ERR, "Failed to receive data\n");
-		return false;
+	device->importing = false;
+	if (device->detached) {
+		device->detached = false;
+		remove_device(device);
+		return;
 	}
 
-	dev->fwd.link = ev->link;
-	ok = forwarding_start(dev);
-	if (!ok) {
-		rh_trace(LVL_ERR, "Device [%s] fwd failed\n", dev->info.manufacturer_name);
-		dev->fwd.link = NULL;
+	if (!import->ok)
+		rh_trace(LVL_DBG, "Import of %s failed\n", device->info.udev.busid);
+}
+
+static uint8_t devlist_wire_interfaces(struct server_usb_device *device)
+{
+	if (device->info.udev.bNumInterfaces > RH_MAX_USB_INTERFACES)
+		return RH_MAX_USB_INTERFACES;
+
+	return device->info.udev.bNumInterfaces;
+}
+
+/* Whole OP_REP_DEVLIST in network order, the devices that are not exported */
+static void fill_devlist_wire(uint8_t *wire, int ndev)
+{
+	struct usbip_op_devlist_reply rep_hdr = {0};
+	struct usbip_op_common hdr = {0};
+	struct server_usb_device *device;
+	struct usbip_usb_device udev;
+	uint8_t interfaces;
+	size_t len;
+
+	hdr.version = htons(USBIP_DEFAULT_PROTOCOL_VERSION);
+	hdr.code = htons(USBIP_OP_REP_DEVLIST);
+	hdr.status = htonl(USBIP_ST_OK);
+	memcpy(wire, &hdr, sizeof(hdr));
+	wire += sizeof(hdr);
+
+	rep_hdr.ndev = ndev;
+	usbip_net_devlist_reply_to_network_order(&rep_hdr);
+	memcpy(wire, &rep_hdr, sizeof(rep_hdr));
+	wire += sizeof(rep_hdr);
+
+	for (device = usb_head; device; device = device->next) {
+		if (device->info.exported)
+			continue;
+
+		interfaces = devlist_wire_interfaces(device);
+		udev = device->info.udev;
+		udev.bNumInterfaces = interfaces;
+		usbip_net_dev_to_network_order(&udev);
+		memcpy(wire, &udev, sizeof(udev));
+		wire += sizeof(udev);
+
+		len = interfaces * sizeof(struct usbip_usb_interface);
+		memcpy(wire, device->info.interface, len);
+		wire += len;
+	}
+}
+
+/* One allocation holds the snapshot, its arrays and the wire reply */
+static struct rh_devicelist *make_snapshot(void)
+{
+	struct server_usb_device *device;
+	struct rh_devicelist *list;
+	int count = 0, ndev = 0, pos;
+	size_t size, wire_len;
+
+	wire_len = sizeof(struct usbip_op_common) + sizeof(struct usbip_op_devlist_reply);
+	for (device = usb_head; device; device = device->next) {
+		count++;
+		if (device->info.exported)
+			continue;
+
+		ndev++;
+		wire_len += sizeof(struct usbip_usb_device) +
+			    devlist_wire_interfaces(device) * sizeof(struct usbip_usb_interface);
+	}
+
+	size = sizeof(struct rh_devicelist) + count * sizeof(struct usb_device_info) +
+	       count * sizeof(uint64_t) + removal_count * sizeof(struct rh_devicelist_removal) +
+	       wire_len;
+	list = calloc(1, size);
+	if (!list) {
+		rh_trace(LVL_ERR, "Alloc failed\n");
+		return NULL;
+	}
+
+	list->generation = devlist_generation;
+	list->refs = 1;
+	list->count = count;
+	list->devices = (struct usb_device_info *)&list[1];
+	list->changed = (uint64_t *)&list->devices[count];
+	list->removed = (struct rh_devicelist_removal *)&list->changed[count];
+	list->wire = (uint8_t *)&list->removed[removal_count];
+	list->wire_len = wire_len;
+	fill_devlist_wire(list->wire, ndev);
+
+	count = 0;
+	for_each_device(device) {
+		list->devices[count] = device->info;
+		list->changed[count] = device->generation;
+		count++;
+	}
+
+	/* Oldest first, anything older than the history may have been missed */
+	pos = (removal_next - removal_count + DEVLIST_REMOVAL_HISTORY) % DEVLIST_REMOVAL_HISTORY;
+	for (int i = 0; i < removal_count; i++)
+		list->removed[i] = removals[(pos + i) % DEVLIST_REMOVAL_HISTORY];
+	list->removed_count = removal_count;
+	if (removal_count == DEVLIST_REMOVAL_HISTORY)
+		list->removed_since = list->removed[0].generation - 1;
+
+	return list;
+}
+
+struct rh_devicelist *rh_devicelist_get(void)
+{
+	struct rh_devicelist *list;
+
+	pthread_mutex_lock(&snapshot_lock);
+	list = devlist_snapshot;
+	if (list)
+		__atomic_add_fetch(&list->refs, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&snapshot_lock);
+
+	return list;
+}
+
+void rh_devicelist_put(struct rh_devicelist *list)
+{
+	if (list && !__atomic_sub_fetch(&list->refs, 1, __ATOMIC_ACQ_REL))
+		free(list);
+}
+
+/*
+ * Reports what changed in the list after the given generation. Returns
+ * false when the removals since then are no longer all known, the whole
+ * list has to be taken then.
+ */
+bool rh_devicelist_diff(const struct rh_devicelist *list, uint64_t since,
+			void (*changed)(const struct usb_device_info *info, void *ctx),
+			void (*removed)(const char *busid, void *ctx), void *ctx)
+{
+	if (since < list->removed_since)
 		return false;
+
+	for (int i = 0; i < list->removed_count; i++) {
+		if (list->removed[i].generation > since)
+			removed(list->removed[i].busid, ctx);
 	}
 
-	rh_trace(LVL_TRC, "Device [%s] forwarding\n", dev->info.manufacturer_name);
+	for (int i = 0; i < list->count; i++) {
+		if (list->changed[i] > since)
+			changed(&list->devices[i], ctx);
+	}
 
 	return true;
 }
 
+/* Publishes the list only when something has changed since the last time */
 static void generate_devicelist(void)
 {
 	struct rh_event event = {0};
-	struct usb_device_info *info = NULL;
-	int dev_count;
+	struct rh_devicelist *list, *old;
+	struct timespec now;
 
-	(void) get_devicelist(&info, &dev_count, true);
+	if (published_generation == devlist_generation)
+		return;
+
+	list = make_snapshot();
+	if (!list)
+		return;
+
+	pthread_mutex_lock(&snapshot_lock);
+	old = devlist_snapshot;
+	devlist_snapshot = list;
+	pthread_mutex_unlock(&snapshot_lock);
+	rh_devicelist_put(old);
+
+	published_generation = list->generation;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	rh_trace(LVL_DBG, "Device list %llu with %d devices published after %lld ms\n",
+		 (unsigned long long)list->generation, list->count,
+		 (long long)(now.tv_sec - start_time.tv_sec) * 1000 +
+		 (now.tv_nsec - start_time.tv_nsec) / 1000000);
 
 	event.type = EVENT_LOCAL_DEVICELIST;
-	event.data = info;
-	event.size = dev_count * sizeof(struct usb_device_info);
+	event.data = list->devices;
+	event.size = list->count * sizeof(struct usb_device_info);
 	(void) event_enqueue(&event);
-	if (info)
-		free(info);
+}
+
+/* Runs in libusb event handling, the device is handled in the USB task */
+static int hotplug_callback(libusb_context *ctx, libusb_device *dev,
+			    libusb_hotplug_event event, void *user_data)
+{
+	struct libusb_device_descriptor desc;
+	struct rh_event ev = {0};
+	struct usb_hotplug hotplug;
+
+	(void) ctx;
+	(void) user_data;
+
+	/* Hubs are never offered, they need not take room on the queue */
+	if (!libusb_get_device_descriptor(dev, &desc) && desc.bDeviceClass == LIBUSB_CLASS_HUB)
+		return 0;
+
+	hotplug.dev = libusb_ref_device(dev);
+	hotplug.arrived = event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED;
+
+	ev.type = EVENT_USB_HOTPLUG;
+	ev.data = &hotplug;
+	ev.size = sizeof(hotplug);
+	if (!event_enqueue(&ev))
+		libusb_unref_device(dev);
+
+	return 0;
+}
+
+static void handle_hotplug(struct usb_hotplug *hotplug)
+{
+	struct server_usb_device *device;
+
+	if (hotplug->arrived) {
+		rh_trace(LVL_DBG, "USB device arrived\n");
+		if (!add_device(hotplug->dev))
+			rh_trace(LVL_ERR, "Out of memory\n");
+	} else {
+		rh_trace(LVL_DBG, "USB device left\n");
+		device = find_device(hotplug->dev);
+		if (device)
+			remove_device(device);
+	}
+
+	libusb_unref_device(hotplug->dev);
+}
+
+static void handle_device_strings(struct usb_strings *strings)
+{
+	struct server_usb_device *device = find_device(strings->dev);
+
+	if (!device)
+		return;
+
+	/* Same as before the strings were read in the background */
+	if (!strings->opened) {
+		rh_trace(LVL_DBG, "Device %s can not be opened\n", device->info.udev.busid);
+		remove_device(device);
+		return;
+	}
+
+	memcpy(device->info.manufacturer_name, strings->manufacturer_name, RH_DEVICE_NAME_MAX_LEN);
+	memcpy(device->info.product_name, strings->product_name, RH_DEVICE_NAME_MAX_LEN);
+
+	/* Put device name into path variable instead of the path itself */
+	snprintf(device->info.udev.path, 256, "%s - %s", device->info.manufacturer_name,
+		 device->info.product_name);
+
+	desc_cache_store(&device->info, &strings->desc);
+	devlist_changed(device);
+}
+
+/* One event covers every device whose strings were read since the last one */
+static void handle_strings(void)
+{
+	struct usb_strings *strings, *next;
+
+	for (strings = usb_strings_take(); strings; strings = next) {
+		next = strings->next;
+		handle_device_strings(strings);
+		libusb_unref_device(strings->dev);
+		free(strings);
+	}
+}
+
+static void init_hotplug(void)
+{
+	int ret;
+
+	if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+		rh_trace(LVL_DBG, "No USB hotplug, rescanning every second\n");
+		return;
+	}
+
+	/*
+	 * Devices already attached are found by the first scan of the USB task.
+	 * Enumerating them here would queue an event for each one before the
+	 * task runs to take them.
+	 */
+	ret = libusb_hotplug_register_callback(usb_context,
+					       LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED |
+					       LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+					       LIBUSB_HOTPLUG_NO_FLAGS,
+					       LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+					       LIBUSB_HOTPLUG_MATCH_ANY, hotplug_callback, NULL,
+					       &hotplug_handle);
+	if (ret != LIBUSB_SUCCESS) {
+		rh_trace(LVL_WARN, "USB hotplug registration failed %s\n",
+			 libusb_error_name(ret));
+		return;
+	}
+
+	hotplug_registered = true;
 }
 
 static void handle_event(struct rh_event *ev)
@@ -711,8 +1101,21 @@ static void handle_event(struct rh_event *ev)
 
 	switch (ev->type) {
 	case EVENT_TIMER_1S:
-		rh_trace(LVL_DBG, "Updating local USB devices\n");
-		update_local_usb_devices();
+		update_exports();
+		if (!hotplug_registered || ++rescan_ticks >= USB_RESCAN_INTERVAL) {
+			rh_trace(LVL_DBG, "Updating local USB devices\n");
+			update_local_usb_devices();
+			rescan_ticks = 0;
+		}
+		generate_devicelist();
+		break;
+	case EVENT_USB_HOTPLUG:
+		handle_hotplug((struct usb_hotplug *)ev->data);
+		update_exports();
+		generate_devicelist();
+		break;
+	case EVENT_USB_STRINGS:
+		handle_strings();
 		generate_devicelist();
 		break;
 	case EVENT_REQ_DEVICELIST:
@@ -727,6 +1130,17 @@ static void handle_event(struct rh_event *ev)
 			free(ev->link);
 		}
 		break;
+	case EVENT_USB_IMPORTED:
+		handle_imported((struct usb_import *)ev->data);
+		/* Stop offering the device in the served list right away */
+		update_exports();
+		generate_devicelist();
+		break;
+	case EVENT_FORWARD_STOPPED:
+		/* The device may be gone already, so all of them are checked */
+		update_exports();
+		generate_devicelist();
+		break;
 	default:
 		return;
 	}
@@ -740,6 +1154,11 @@ static void *usb_loop(void *args)
 	(void)args;
 	rh_trace(LVL_TRC, "USB task starting\n");
 
+	/* Hotplug is already registered, a device attached meanwhile is only added once */
+	update_local_usb_devices();
+	update_exports();
+	generate_devicelist();
+
 	while (usb.running) {
 		ok = event_dequeue(&usb, &event);
 		if (!ok) {
@@ -747,6 +1166,7 @@ static void *usb_loop(void *args)
 			break;
 		}
 		handle_event(event);
+		free(event->data);
 		free(event);
 	}
 
@@ -755,17 +1175,6 @@ static void *usb_loop(void *args)
 	return NULL;
 }
 
-static void *libusb_loop(void *args)
-{
-	(void) args;
-
-	while (libusb_running)
-		libusb_handle_events(usb_context);
-
-	rh_trace(LVL_TRC, "Libusb stopped\n");
-	return NULL;
-}
-
 void usb_exit(void)
 {
 	struct server_usb_device *device;
@@ -778,6 +1187,13 @@ void usb_exit(void)
 
 	rh_trace(LVL_TRC, "Running cleanup\n");
 
+	if (hotplug_registered)
+		libusb_hotplug_deregister_callback(usb_context, hotplug_handle);
+	hotplug_registered = false;
+
+	usb_strings_exit();
+	usb_import_exit();
+
 	for_each_device(device) {
 		terminate_forward(device);
 		libusb_unref_device(device->fwd.libusb_dev);
@@ -785,23 +1201,56 @@ void usb_exit(void)
 	}
 
 	delete_bus_info();
-
-	libusb_running = false;
-
-	if (libusb_thread) {
-		libusb_interrupt_event_handler(usb_context);
-		pthread_join(libusb_thread, NULL);
+	desc_cache_clear();
+
+	pthread_mutex_lock(&snapshot_lock);
+	rh_devicelist_put(devlist_snapshot);
+	devlist_snapshot = NULL;
+	pthread_mutex_unlock(&snapshot_lock);
+
+	if (reactor_running) {
+		uring_exit();
+		reactor_exit();
+		reactor_running = false;
+		for (int i = 1; i < usb_shard_count; i++)
+			libusb_exit(usb_shards[i]);
+		usb_shard_count = 0;
 		libusb_exit(usb_context);
 		rh_trace(LVL_TRC, "LibUSB terminated\n");
 	}
 	rh_trace(LVL_TRC, "USB terminated\n");
 }
 
-bool usb_task_init(void)
+/* One context per core unless configured, each handles its events on one worker at a time */
+static void init_usb_shards(uint32_t configured)
+{
+	long count = configured ? (long)configured : sysconf(_SC_NPROCESSORS_ONLN);
+	int ret;
+
+	if (count < 1)
+		count = 1;
+	if (count > REACTOR_MAX_USB_CONTEXTS)
+		count = REACTOR_MAX_USB_CONTEXTS;
+
+	usb_shards[0] = usb_context;
+	for (usb_shard_count = 1; usb_shard_count < count; usb_shard_count++) {
+		ret = libusb_init(&usb_shards[usb_shard_count]);
+		if (ret < 0) {
+			rh_trace(LVL_WARN, "Libusb context %d init failed %d, %s\n",
+				 usb_shard_count, ret, libusb_error_name(ret));
+			break;
+		}
+	}
+
+	rh_trace(LVL_DBG, "Exports spread over %d libusb contexts\n", usb_shard_count);
+}
+
+bool usb_task_init(struct server_info info)
 {
 	int ret;
 
 	rh_trace(LVL_TRC, "USB init\n");
+	clock_gettime(CLOCK_MONOTONIC, &start_time);
 
 	ret = libusb_init(&usb_context);
 	if (ret < 0) {
@@ -811,20 +1260,36 @@ bool usb_task_init(void)
 		return false;
 	}
 
+	init_usb_shards(info.usb_contexts);
+	forwarding_init(info, usb_shards, usb_shard_count);
+
 	pthread_mutex_init(&usb_conf_lock, NULL);
 
 	//libusb_set_debug(NULL, LIBUSB_LOG_LEVEL_DEBUG);
 
+	/* Forwarded devices and libusb events share the reactor workers */
 	usb.running = true;
-	if (pthread_create(&libusb_thread, NULL, libusb_loop, NULL)) {
+	reactor_running = reactor_init(usb_shards, usb_shard_count);
+	if (!reactor_running) {
 		rh_trace(LVL_ERR, "Failed to start libUSB device handling\n");
 		return false;
 	}
 
-	usb.event_mask = EVENT_TIMER_1S | EVENT_REQ_DEVICELIST | EVENT_REQ_IMPORT;
+	/* Plain TCP links fall back to the reactor when the ring is not there */
+	if (info.io_uring && !uring_init())
+		rh_trace(LVL_WARN, "io_uring not available, forwarding without it\n");
+
+	usb.event_mask = EVENT_TIMER_1S | EVENT_REQ_DEVICELIST | EVENT_REQ_IMPORT |
+			 EVENT_USB_HOTPLUG | EVENT_USB_STRINGS | EVENT_USB_IMPORTED |
+			 EVENT_FORWARD_STOPPED;
 	strcpy(usb.task_name, "USB task");
 	event_task_register(&usb);
 
+	if (!usb_strings_init() || !usb_import_init())
+		return false;
+
+	init_hotplug();
+
 	if (pthread_create(&usb_thread, NULL, usb_loop, NULL)) {
 		rh_trace(LVL_ERR, "Failed to start USB device handling\n");
 		return false;
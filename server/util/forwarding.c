@@ -20,8 +20,12 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <time.h>
 
 #include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 #include <libusb-1.0/libusb.h>
 
 #include "usb.h"
@@ -31,111 +35,389 @@
 #include "event.h"
 #include "logging.h"
 #include "network.h"
+#include "pool.h"
+#include "reactor.h"
+#include "uring.h"
 
-static void enqueue_packet(struct forward_info *f_dev, struct usb_packet *packet)
+static struct server_info fwd_conf;
+
+/* libusb contexts and the count of exports running on each */
+static libusb_context **usb_shards;
+static int usb_shard_count;
+static uint32_t shard_exports[REACTOR_MAX_USB_CONTEXTS];
+static pthread_mutex_t shard_lock = PTHREAD_MUTEX_INITIALIZER;
+
+enum rx_result {
+	RX_DONE,	/* Step finished, go on with the next one */
+	RX_AGAIN,	/* Waiting for the link or for credits */
+	RX_FAIL,
+};
+
+static struct usb_packet **inflight_bucket(struct forward_info *f_dev, uint32_t seqnum)
+{
+	return &f_dev->inflight[seqnum & f_dev->inflight_mask];
+}
+
+static void inflight_insert(struct forward_info *f_dev, struct usb_packet *packet)
 {
-	struct usb_packet *tmp;
+	struct usb_packet **bucket = inflight_bucket(f_dev, packet->hdr.base.seqnum);
 
-	if (!f_dev->buffer_head) {
-		f_dev->buffer_head = packet;
-		f_dev->buffer_head->next = NULL;
-	} else {
-		tmp = f_dev->buffer_head;
-		while (tmp->next)
-			tmp = tmp->next;
-		tmp->next = packet;
+	packet->hnext = *bucket;
+	*bucket = packet;
+}
+
+static struct usb_packet *inflight_find(struct forward_info *f_dev, uint32_t seqnum)
+{
+	struct usb_packet *tmp = *inflight_bucket(f_dev, seqnum);
+
+	while (tmp && tmp->hdr.base.seqnum != seqnum)
+		tmp = tmp->hnext;
+
+	return tmp;
+}
+
+static void inflight_remove(struct forward_info *f_dev, struct usb_packet *packet)
+{
+	struct usb_packet **tmp = inflight_bucket(f_dev, packet->hdr.base.seqnum);
+
+	while (*tmp && *tmp != packet)
+		tmp = &(*tmp)->hnext;
+
+	if (*tmp)
+		*tmp = packet->hnext;
+	packet->hnext = NULL;
+}
+
+static int submit_packet(struct forward_info *f_dev, struct usb_packet *packet)
+{
+	int ret;
+
+	/* Counted first, the completion may run before libusb returns */
+	__atomic_add_fetch(&f_dev->packets_inflight, 1, __ATOMIC_RELAXED);
+
+	ret = libusb_submit_transfer(packet->xfer);
+	if (ret != 0) {
+		__atomic_sub_fetch(&f_dev->packets_inflight, 1, __ATOMIC_RELAXED);
+		return ret;
 	}
+
+	packet->submitted = true;
+	packet->ep_queue->queued++;
+
+	return 0;
 }
 
-static bool dequeue_ready_packet(struct forward_info *f_dev, struct usb_packet **packet)
+static void backlog_append(struct forward_info *f_dev, struct usb_packet *packet)
 {
-	struct usb_packet *tmp, *prev;
-	bool found = false;
+	struct ep_queue *epq = packet->ep_queue;
+
+	packet->next = NULL;
+	if (!epq->backlog_tail)
+		epq->backlog_head = packet;
+	else
+		epq->backlog_tail->next = packet;
+	epq->backlog_tail = packet;
+	f_dev->packets_backlogged++;
+}
 
-	pthread_mutex_lock(&f_dev->buffer_lock);
+static void backlog_remove(struct forward_info *f_dev, struct usb_packet *packet)
+{
+	struct ep_queue *epq = packet->ep_queue;
+	struct usb_packet **tmp = &epq->backlog_head, *prev = NULL;
 
-	if (!f_dev->buffer_head) {
-		pthread_mutex_unlock(&f_dev->buffer_lock);
-		return false;
+	while (*tmp && *tmp != packet) {
+		prev = *tmp;
+		tmp = &(*tmp)->next;
 	}
 
-	if (f_dev->buffer_head->ready) {
-		*packet = f_dev->buffer_head;
-		f_dev->buffer_head = f_dev->buffer_head->next;
-		f_dev->packets_ready--;
-		found = true;
-	} else {
-		tmp = f_dev->buffer_head->next;
-		prev = f_dev->buffer_head;
-		while (tmp) {
-			if (tmp->ready) {
-				*packet = tmp;
-				prev->next = tmp->next;
-				found = true;
-				f_dev->packets_ready--;
-				break;
-			}
-			prev = tmp;
-			tmp = tmp->next;
+	if (!*tmp)
+		return;
+
+	*tmp = packet->next;
+	if (epq->backlog_tail == packet)
+		epq->backlog_tail = prev;
+	packet->next = NULL;
+	f_dev->packets_backlogged--;
+}
+
+/* Submits what fits from the backlog */
+static bool ep_queue_kick(struct forward_info *f_dev, struct ep_queue *epq)
+{
+	struct usb_packet *packet;
+	int ret;
+
+	while (epq->backlog_head && epq->queued < epq->depth) {
+		packet = epq->backlog_head;
+		backlog_remove(f_dev, packet);
+
+		ret = submit_packet(f_dev, packet);
+		if (ret != 0) {
+			rh_trace(LVL_ERR, "Backlog submit failed %s\n", libusb_strerror(ret));
+			/* The packet stays in the table and is freed at teardown */
+			f_dev->terminate = true;
+			return false;
 		}
 	}
 
-	pthread_mutex_unlock(&f_dev->buffer_lock);
-	return found;
+	return true;
 }
 
-static bool dequeue_any_packet(struct forward_info *f_dev, struct usb_packet **packet)
+/* Replies made by the handler itself skip the completion stack */
+static void enqueue_ready_packet(struct forward_info *f_dev, struct usb_packet *packet)
 {
-	bool found = false;
+	packet->next = NULL;
+	__atomic_store_n(&packet->ready, true, __ATOMIC_RELAXED);
+
+	if (!f_dev->ready_tail)
+		f_dev->ready_head = packet;
+	else
+		f_dev->ready_tail->next = packet;
+	f_dev->ready_tail = packet;
+}
 
-	pthread_mutex_lock(&f_dev->buffer_lock);
+/*
+ * Completions are pushed on a lock-free stack from the libusb workers.
+ * Returns true for the push that found the stack empty, only that one has
+ * to wake the handler since the handler takes the whole stack at once.
+ */
+static bool publish_completion(struct forward_info *f_dev, struct usb_packet *packet)
+{
+	struct usb_packet *head = __atomic_load_n(&f_dev->completed, __ATOMIC_RELAXED);
+
+	__atomic_store_n(&packet->ready, true, __ATOMIC_RELAXED);
+
+	do {
+		packet->next = head;
+	} while (!__atomic_compare_exchange_n(&f_dev->completed, &head, packet, true,
+					      __ATOMIC_RELEASE, __ATOMIC_RELAXED));
 
-	if (f_dev->buffer_head) {
-		*packet = f_dev->buffer_head;
-		f_dev->buffer_head = f_dev->buffer_head->next;
-		f_dev->packets_ready--;
-		found = true;
+	return !head;
+}
+
+/* Moves the published completions to the ready list in completion order */
+static void collect_completions(struct forward_info *f_dev)
+{
+	struct usb_packet *packet, *next, *first = NULL;
+
+	packet = __atomic_exchange_n(&f_dev->completed, NULL, __ATOMIC_ACQUIRE);
+	while (packet) {
+		next = packet->next;
+		packet->next = first;
+		first = packet;
+		packet = next;
 	}
 
-	pthread_mutex_unlock(&f_dev->buffer_lock);
-	return found;
+	if (!first)
+		return;
+
+	if (!f_dev->ready_tail)
+		f_dev->ready_head = first;
+	else
+		f_dev->ready_tail->next = first;
+
+	for (packet = first; packet->next; packet = packet->next)
+		;
+	f_dev->ready_tail = packet;
+}
+
+static bool dequeue_ready_packet(struct forward_info *f_dev, struct usb_packet **packet)
+{
+	if (!f_dev->ready_head)
+		collect_completions(f_dev);
+
+	if (!f_dev->ready_head)
+		return false;
+
+	*packet = f_dev->ready_head;
+	f_dev->ready_head = (*packet)->next;
+	if (!f_dev->ready_head)
+		f_dev->ready_tail = NULL;
+
+	/* Unlink replies for already sent packets were never in the table */
+	inflight_remove(f_dev, *packet);
+
+	if ((*packet)->ep_queue) {
+		(*packet)->ep_queue->queued--;
+		if ((*packet)->ep_queue->backlog_head && !f_dev->terminate)
+			ep_queue_kick(f_dev, (*packet)->ep_queue);
+	}
+
+	return true;
+}
+
+static void fifo_push(struct usb_packet **head, struct usb_packet **tail,
+		      struct usb_packet *packet)
+{
+	packet->next = NULL;
+	if (!*tail)
+		*head = packet;
+	else
+		(*tail)->next = packet;
+	*tail = packet;
+}
+
+static struct usb_packet *fifo_pop(struct usb_packet **head, struct usb_packet **tail)
+{
+	struct usb_packet *packet = *head;
+
+	if (!packet)
+		return NULL;
+
+	*head = packet->next;
+	if (!*head)
+		*tail = NULL;
+	packet->next = NULL;
+
+	return packet;
+}
+
+static bool fifo_remove(struct usb_packet **head, struct usb_packet **tail,
+			struct usb_packet *packet)
+{
+	struct usb_packet **tmp = head, *prev = NULL;
+
+	while (*tmp && *tmp != packet) {
+		prev = *tmp;
+		tmp = &(*tmp)->next;
+	}
+
+	if (!*tmp)
+		return false;
+
+	*tmp = packet->next;
+	if (*tail == packet)
+		*tail = prev;
+	packet->next = NULL;
+
+	return true;
+}
+
+/* Takes a client read off the ones waiting for a read ahead */
+static void unpark_packet(struct forward_info *f_dev, struct usb_packet *packet)
+{
+	struct int_prefetch *pf = &f_dev->prefetch[packet->hdr.base.ep & USB_ENDPOINT_NUMBER_MASK];
+
+	packet->parked = false;
+	if (fifo_remove(&pf->wait_head, &pf->wait_tail, packet))
+		return;
+
+	/* The client gave up on the command, the next one drops its read ahead */
+	if (fifo_remove(&f_dev->bot.wait_head, &f_dev->bot.wait_tail, packet))
+		f_dev->bot.stale = true;
 }
 
 static bool unlink_packet(struct forward_info *f_dev, uint32_t target_seqnum,
 			  uint32_t unlink_seqnum)
 {
-	struct usb_packet *tmp, *unlink;
-	bool found = false;
+	struct usb_packet *unlink;
 
-	pthread_mutex_lock(&f_dev->buffer_lock);
-
-	if (!f_dev->buffer_head) {
-		pthread_mutex_unlock(&f_dev->buffer_lock);
+	unlink = inflight_find(f_dev, target_seqnum);
+	if (unlink && unlink->answered) {
+		/* Its reply is already on the way, the unlink is answered as too late */
 		return false;
+	} else if (unlink && unlink->parked) {
+		/* Nothing at the device, complete it as cancelled right away */
+		unpark_packet(f_dev, unlink);
+		unlink->unlinked = unlink_seqnum;
+		enqueue_ready_packet(f_dev, unlink);
+	} else if (unlink && !unlink->submitted) {
+		/* Never reached the device, complete it as cancelled right away */
+		backlog_remove(f_dev, unlink);
+		unlink->ep_queue->queued++;
+		unlink->unlinked = unlink_seqnum;
+		enqueue_ready_packet(f_dev, unlink);
+	} else if (unlink) {
+		unlink->unlinked = unlink_seqnum;
+		libusb_cancel_transfer(unlink->xfer);
 	}
 
-	if (f_dev->buffer_head->hdr.base.seqnum == target_seqnum) {
-		unlink = f_dev->buffer_head;
-		found = true;
-	} else {
-		tmp = f_dev->buffer_head;
-		while (tmp) {
-			if (tmp->hdr.base.seqnum == target_seqnum) {
-				unlink = tmp;
-				found = true;
-				break;
-			}
-			tmp = tmp->next;
+	return unlink != NULL;
+}
+
+/* Makes the reactor run the handler of the device */
+static void forward_wake(struct forward_info *f_dev)
+{
+	uint64_t one = 1;
+
+	if (write(f_dev->wake_src.fd, &one, sizeof(one)) != sizeof(one))
+		rh_trace(LVL_ERR, "Device wakeup failed %d\n", errno);
+}
+
+/* Received data already sits in the ring buffers, so it is copied straight over */
+static enum rx_result rx_fill_uring(struct forward_info *f_dev, uint8_t *data, uint32_t len)
+{
+	int ret;
+
+	while (f_dev->rx_got < len) {
+		ret = uring_recv(&f_dev->uring, &data[f_dev->rx_got], len - f_dev->rx_got);
+		if (!ret)
+			return RX_AGAIN;
+		if (ret < 0) {
+			rh_trace(LVL_WARN, "Network rcv fail rcvd:%d\n", f_dev->rx_got);
+			return RX_FAIL;
 		}
+		f_dev->stats.rx_reads++;
+		f_dev->stats.rx_bytes += ret;
+		f_dev->rx_got += ret;
 	}
 
-	if (found) {
-		unlink->unlinked = unlink_seqnum;
-		libusb_cancel_transfer(unlink->xfer);
+	f_dev->rx_got = 0;
+	return RX_DONE;
+}
+
+/*
+ * Reads from the link through the RX buffer so that one receive picks up all
+ * of the commands the client has queued. Reads of large payloads that do not
+ * fit the buffered data go straight to the destination. rx_got keeps the
+ * progress while the link has nothing more to give.
+ */
+static enum rx_result rx_fill(struct forward_info *f_dev, uint8_t *data, uint32_t len)
+{
+	uint32_t avail;
+	bool direct;
+	int ret;
+
+	if (f_dev->uring.active)
+		return rx_fill_uring(f_dev, data, len);
+
+	while (f_dev->rx_got < len) {
+		avail = f_dev->rx_tail - f_dev->rx_head;
+		if (avail) {
+			if (avail > len - f_dev->rx_got)
+				avail = len - f_dev->rx_got;
+			memcpy(&data[f_dev->rx_got], &f_dev->rx_buf[f_dev->rx_head], avail);
+			f_dev->rx_head += avail;
+			f_dev->rx_got += avail;
+			continue;
+		}
+
+		f_dev->rx_head = 0;
+		f_dev->rx_tail = 0;
+
+		direct = len - f_dev->rx_got >= RX_DIRECT_THRESHOLD;
+		if (direct)
+			ret = network_recv(f_dev->link, &data[f_dev->rx_got], len - f_dev->rx_got);
+		else
+			ret = network_recv(f_dev->link, f_dev->rx_buf, RX_BUFFER_SIZE);
+
+		if (ret <= 0 && network_would_block(f_dev->link, ret))
+			return RX_AGAIN;
+		if (ret <= 0) {
+			rh_trace(LVL_WARN, "Network rcv fail %d rcvd:%d, %d\n",
+				 errno, f_dev->rx_got, ret);
+			return RX_FAIL;
+		}
+		f_dev->stats.rx_reads++;
+		f_dev->stats.rx_bytes += ret;
+
+		if (direct)
+			f_dev->rx_got += ret;
+		else
+			f_dev->rx_tail = ret;
 	}
 
-	pthread_mutex_unlock(&f_dev->buffer_lock);
-	return found;
+	f_dev->rx_got = 0;
+	return RX_DONE;
 }
 
 static int convert_libusb_status(enum libusb_transfer_status xfer_status)
@@ -159,6 +441,219 @@ static int convert_libusb_status(enum libusb_transfer_status xfer_status)
 	return -ENOENT;
 }
 
+static struct desc_entry *desc_cache_find(struct forward_info *f_dev, uint16_t wValue,
+					   uint16_t wIndex)
+{
+	struct desc_entry *entry;
+
+	for (entry = f_dev->desc_cache; entry; entry = entry->next) {
+		if (entry->wValue == wValue && entry->wIndex == wIndex)
+			return entry;
+	}
+
+	return NULL;
+}
+
+static void desc_cache_clear(struct forward_info *f_dev)
+{
+	struct desc_entry *entry;
+
+	while (f_dev->desc_cache) {
+		entry = f_dev->desc_cache;
+		f_dev->desc_cache = entry->next;
+		free(entry);
+	}
+}
+
+/* Reads the descriptor from the device into the cache */
+static struct desc_entry *desc_cache_add(struct forward_info *f_dev, uint16_t wValue,
+					 uint16_t wIndex, uint8_t *buf)
+{
+	struct desc_entry *entry;
+	int ret;
+
+	entry = desc_cache_find(f_dev, wValue, wIndex);
+	if (entry)
+		return entry;
+
+	ret = libusb_control_transfer(f_dev->handle, LIBUSB_ENDPOINT_IN,
+				      LIBUSB_REQUEST_GET_DESCRIPTOR, wValue, wIndex, buf,
+				      DESC_CACHE_MAX_LEN, DESC_CACHE_TIMEOUT_MS);
+	/* A full buffer may have been cut short */
+	if (ret < 2 || ret >= DESC_CACHE_MAX_LEN || buf[1] != wValue >> 8)
+		return NULL;
+
+	entry = malloc(sizeof(struct desc_entry) + ret);
+	if (!entry)
+		return NULL;
+
+	entry->wValue = wValue;
+	entry->wIndex = wIndex;
+	entry->len = ret;
+	memcpy(entry->data, buf, ret);
+	entry->next = f_dev->desc_cache;
+	f_dev->desc_cache = entry;
+
+	return entry;
+}
+
+/*
+ * Captures what the client reads when it enumerates the device: the device,
+ * config and BOS descriptors and the strings these refer to.
+ */
+static void desc_cache_capture(struct forward_info *f_dev)
+{
+	uint8_t strings[3 + DESC_CACHE_MAX_CONFIGS];
+	struct desc_entry *device, *config, *langs;
+	int configs, count = 0;
+	uint16_t langid;
+	uint8_t *buf;
+
+	buf = malloc(DESC_CACHE_MAX_LEN);
+	if (!buf)
+		return;
+
+	device = desc_cache_add(f_dev, LIBUSB_DT_DEVICE << 8, 0, buf);
+	if (!device || device->len < LIBUSB_DT_DEVICE_SIZE)
+		goto out;
+
+	/* iManufacturer, iProduct and iSerialNumber */
+	memcpy(strings, &device->data[14], 3);
+	count = 3;
+
+	configs = device->data[17];
+	if (configs > DESC_CACHE_MAX_CONFIGS)
+		configs = DESC_CACHE_MAX_CONFIGS;
+
+	for (int i = 0; i < configs; i++) {
+		config = desc_cache_add(f_dev, LIBUSB_DT_CONFIG << 8 | i, 0, buf);
+		if (config && config->len > 6)
+			strings[count++] = config->data[6];
+	}
+
+	/* BOS came with USB 2.01 */
+	if ((device->data[2] | device->data[3] << 8) >= 0x0201)
+		desc_cache_add(f_dev, LIBUSB_DT_BOS << 8, 0, buf);
+
+	langs = desc_cache_add(f_dev, LIBUSB_DT_STRING << 8, 0, buf);
+	if (!langs || langs->len < 4)
+		goto out;
+
+	/* The strings in the first language, the one clients ask for */
+	langid = langs->data[2] | langs->data[3] << 8;
+	for (int i = 0; i < count; i++) {
+		if (strings[i])
+			desc_cache_add(f_dev, LIBUSB_DT_STRING << 8 | strings[i], langid, buf);
+	}
+
+out:
+	free(buf);
+}
+
+static void free_streams(struct forward_info *f_dev)
+{
+	int ret;
+
+	if (!f_dev->streams)
+		return;
+
+	ret = libusb_free_streams(f_dev->handle, f_dev->stream_eps, f_dev->stream_ep_count);
+	if (ret)
+		rh_trace(LVL_DBG, "Freeing streams failed %s\n", libusb_error_name(ret));
+
+	f_dev->streams = 0;
+	f_dev->stream_ep_count = 0;
+}
+
+/* Bulk endpoints that can have streams, and the streams they all have */
+static uint32_t stream_endpoints(const struct libusb_interface_descriptor *alt,
+				 uint8_t *eps, int *count)
+{
+	struct libusb_ss_endpoint_companion_descriptor *comp;
+	const struct libusb_endpoint_descriptor *ep;
+	uint32_t streams = STREAM_MAX_COUNT;
+	uint8_t exponent;
+
+	*count = 0;
+	for (int i = 0; i < alt->bNumEndpoints && *count < STREAM_MAX_EPS; i++) {
+		ep = &alt->endpoint[i];
+		if ((ep->bmAttributes & USB_ENDPOINT_XFERTYPE_MASK) != USB_ENDPOINT_XFER_BULK)
+			continue;
+
+		if (libusb_get_ss_endpoint_companion_descriptor(NULL, ep, &comp))
+			continue;
+
+		/* The UAS command pipe has none */
+		exponent = comp->bmAttributes & 0x1f;
+		libusb_free_ss_endpoint_companion_descriptor(comp);
+		if (!exponent)
+			continue;
+
+		eps[(*count)++] = ep->bEndpointAddress;
+		if ((1U << exponent) < streams)
+			streams = 1U << exponent;
+	}
+
+	return *count ? streams : 0;
+}
+
+/* Streams are allocated when the client selects the UAS altsetting */
+static void setup_streams(struct forward_info *f_dev, uint16_t interface, uint16_t alternate)
+{
+	const struct libusb_interface_descriptor *alt = NULL;
+	const struct libusb_interface *intf;
+	struct libusb_config_descriptor *config;
+	uint32_t streams;
+	int ret;
+
+	free_streams(f_dev);
+
+	if (libusb_get_active_config_descriptor(libusb_get_device(f_dev->handle), &config))
+		return;
+
+	for (int i = 0; i < config->bNumInterfaces && !alt; i++) {
+		intf = &config->interface[i];
+		for (int j = 0; j < intf->num_altsetting; j++) {
+			if (intf->altsetting[j].bInterfaceNumber == interface &&
+			    intf->altsetting[j].bAlternateSetting == alternate) {
+				alt = &intf->altsetting[j];
+				break;
+			}
+		}
+	}
+
+	if (!alt || alt->bInterfaceClass != USB_CLASS_MASS_STORAGE ||
+	    alt->bInterfaceSubClass != USB_SC_SCSI || alt->bInterfaceProtocol != USB_PR_UAS)
+		goto out;
+
+	streams = stream_endpoints(alt, f_dev->stream_eps, &f_dev->stream_ep_count);
+	if (!streams)
+		goto out;
+
+	ret = libusb_alloc_streams(f_dev->handle, streams, f_dev->stream_eps,
+				   f_dev->stream_ep_count);
+	if (ret <= 0) {
+		rh_trace(LVL_ERR, "Allocating streams failed %s\n", libusb_error_name(ret));
+		f_dev->stream_ep_count = 0;
+		goto out;
+	}
+
+	f_dev->streams = ret;
+	rh_trace(LVL_DBG, "%d streams on %d endpoints\n", ret, f_dev->stream_ep_count);
+out:
+	libusb_free_config_descriptor(config);
+}
+
+static bool stream_endpoint(struct forward_info *f_dev, uint8_t endpoint)
+{
+	for (int i = 0; i < f_dev->stream_ep_count; i++) {
+		if (f_dev->stream_eps[i] == endpoint)
+			return true;
+	}
+
+	return false;
+}
+
 static void intercept_control_packet(struct forward_info *f_dev, struct usbip_header *hdr)
 {
 	uint16_t interface, alternate;
@@ -173,6 +668,7 @@ static void intercept_control_packet(struct forward_info *f_dev, struct usbip_he
 								(wValue == USB_ENDPOINT_HALT)) {
 		clear_halt_ep = libusb_le16_to_cpu(req->wIndex) & 0x008F;
 		rh_trace(LVL_DBG, "Clearing halt from ep 0x%x\n", clear_halt_ep);
+		f_dev->bot.stale = true;
 		ret = libusb_clear_halt(f_dev->handle, clear_halt_ep);
 		if (ret) {
 			rh_trace(LVL_ERR, "Clearing halt from ep 0x%x failed\n", clear_halt_ep);
@@ -183,11 +679,21 @@ static void intercept_control_packet(struct forward_info *f_dev, struct usbip_he
 	if ((req->bRequest == USB_REQ_SET_FEATURE) && (req->bRequestType == USB_RT_PORT) &&
 								(wValue == USB_PORT_FEAT_RESET)) {
 		rh_trace(LVL_DBG, "Reset command received\n");
+		desc_cache_clear(f_dev);
+		free_streams(f_dev);
+		f_dev->bot.stale = true;
 		libusb_reset_device(f_dev->handle);
 	}
 
+	if ((req->bRequest == BOT_RESET_REQUEST) &&
+				(req->bRequestType == (USB_TYPE_CLASS | USB_RECIP_INTERFACE))) {
+		rh_trace(LVL_DBG, "Mass storage reset received\n");
+		f_dev->bot.stale = true;
+	}
+
 	if ((req->bRequest == USB_REQ_SET_CONFIGURATION) &&
 							(req->bRequestType == USB_RECIP_DEVICE)) {
+		desc_cache_clear(f_dev);
 		rh_trace(LVL_DBG, "Config changing not supported (cfg %d)\n",
 				   libusb_le16_to_cpu(req->wValue));
 	}
@@ -202,6 +708,7 @@ static void intercept_control_packet(struct forward_info *f_dev, struct usbip_he
 			return;
 		}
 		rh_trace(LVL_DBG, "Set interface %d, altsetting %d\n", interface, alternate);
+		setup_streams(f_dev, interface, alternate);
 	}
 }
 
@@ -277,13 +784,9 @@ static int release_device(struct server_usb_device *dev)
 static void xfer_completion_callback(struct libusb_transfer *transfer)
 {
 	struct usb_packet *packet = (struct usb_packet *)transfer->user_data;
-	pthread_cond_t *buffer_cond;
-	pthread_mutex_t *buffer_lock;
+	struct forward_info *f_dev = packet->f_dev;
 	uint32_t act_len = 0;
-
-	pthread_mutex_lock(&packet->f_dev->buffer_lock);
-	buffer_cond = &packet->f_dev->buffer_cond;
-	buffer_lock = &packet->f_dev->buffer_lock;
+	bool wake;
 
 	if (transfer->status == LIBUSB_TRANSFER_CANCELLED) {
 		rh_trace(LVL_DBG, "LIBUSB_TRANSFER_CANCELLED\n");
@@ -293,8 +796,7 @@ static void xfer_completion_callback(struct libusb_transfer *transfer)
 
 	if (transfer->status == LIBUSB_TRANSFER_NO_DEVICE) {
 		rh_trace(LVL_DBG, "LIBUSB_TRANSFER_NO_DEVICE\n");
-		network_shut_link(packet->f_dev->link);
-		packet->f_dev->terminate = true;
+		__atomic_store_n(&f_dev->terminate, true, __ATOMIC_RELAXED);
 		goto end;
 	}
 
@@ -314,10 +816,20 @@ static void xfer_completion_callback(struct libusb_transfer *transfer)
 	}
 
 end:
-	packet->f_dev->packets_ready++;
-	packet->ready = true;
-	pthread_mutex_unlock(buffer_lock);
-	pthread_cond_signal(buffer_cond);
+	wake = publish_completion(f_dev, packet);
+
+	/*
+	 * The teardown frees nothing before the count drops to zero. Once it
+	 * waits for the count, the last completion has to wake it even when
+	 * the stack was not empty.
+	 */
+	if (!__atomic_sub_fetch(&f_dev->packets_inflight, 1, __ATOMIC_SEQ_CST) &&
+	    __atomic_load_n(&f_dev->cancelled, __ATOMIC_SEQ_CST))
+		wake = true;
+
+	/* forwarding_wait quiesces the reactor before the wakeup is closed */
+	if (wake)
+		forward_wake(f_dev);
 }
 
 static uint8_t get_xfer_type(struct server_usb_device *dev, uint32_t dir, uint8_t ep)
@@ -339,110 +851,138 @@ static uint8_t get_xfer_type(struct server_usb_device *dev, uint32_t dir, uint8_
 	return dev->info.ep_out_type[epnum];
 }
 
-static uint8_t set_endpoint(uint8_t ep, uint32_t dir)
+static struct ep_queue *get_ep_queue(struct forward_info *f_dev, uint32_t dir, uint8_t ep)
 {
-	if (ep == 0)
-		return 0;
-
-	if (dir == USBIP_DIR_IN)
-		ep |= USB_DIR_IN;
+	uint8_t epnum = ep & USB_ENDPOINT_NUMBER_MASK;
 
-	return ep;
+	return &f_dev->ep[dir == USBIP_DIR_IN ? 16 + epnum : epnum];
 }
 
-static int receive_iso(struct forward_info *f_dev, int num_iso, struct libusb_transfer *xfer)
+static void init_ep_queues(struct server_usb_device *dev)
 {
-	bool ok;
-	struct usbip_iso_packet_descriptor *usbip_iso, tmp_iso;
+	uint8_t type;
 
-	usbip_iso = calloc(num_iso * sizeof(struct usbip_iso_packet_descriptor), 1UL);
-	if (!usbip_iso) {
-		rh_trace(LVL_ERR, "Can't allocate memory\n");
-		return -1;
-	}
+	memset(dev->fwd.ep, 0, sizeof(dev->fwd.ep));
 
-	ok = network_recv_data(f_dev->link, (uint8_t *)usbip_iso,
-				num_iso * sizeof(struct usbip_iso_packet_descriptor));
-	if (!ok) {
-		rh_trace(LVL_ERR, "Isonchronous data receive failed\n");
-		free(usbip_iso);
-		return -1;
-	}
+	for (int i = 0; i < EP_QUEUE_COUNT; i++) {
+		if (i % 16 == 0)
+			type = USB_ENDPOINT_XFER_CONTROL;
+		else if (i >= 16)
+			type = dev->info.ep_in_type[i - 16];
+		else
+			type = dev->info.ep_out_type[i];
 
-	for (int i = 0; i < num_iso; i++) {
-		tmp_iso = usbip_iso[i];
-		xfer->iso_packet_desc[i].length = ntohl(tmp_iso.length);
-		xfer->iso_packet_desc[i].actual_length = ntohl(tmp_iso.actual_length);
-		xfer->iso_packet_desc[i].status = ntohl(tmp_iso.status);
+		switch (type) {
+		case USB_ENDPOINT_XFER_ISOC:
+			dev->fwd.ep[i].depth = EP_DEPTH_ISOC;
+			break;
+		case USB_ENDPOINT_XFER_BULK:
+			dev->fwd.ep[i].depth = EP_DEPTH_BULK;
+			break;
+		case USB_ENDPOINT_XFER_INT:
+			dev->fwd.ep[i].depth = EP_DEPTH_INT;
+			break;
+		default:
+			dev->fwd.ep[i].depth = EP_DEPTH_CONTROL;
+			break;
+		}
 	}
+}
 
-	free(usbip_iso);
+static bool device_has_class(struct server_usb_device *dev, uint8_t usb_class)
+{
+	if (dev->info.udev.bDeviceClass)
+		return dev->info.udev.bDeviceClass == usb_class;
 
-	return 0;
+	/* Class defined per interface */
+	for (int i = 0; i < dev->info.udev.bNumInterfaces && i < RH_MAX_USB_INTERFACES; i++) {
+		if (dev->info.interface[i].bInterfaceClass == usb_class)
+			return true;
+	}
+
+	return false;
 }
 
-static bool submit_xfer(struct server_usb_device *dev, struct usb_packet *packet,
-			uint8_t *data_buffer)
+static void init_flow_budget(struct server_usb_device *dev)
 {
-	int ret, offset = packet->hdr.base.ep == 0 ? 8 : 0;
-	struct libusb_transfer *xfer;
-
-	uint32_t dir = packet->hdr.base.direction;
-	uint8_t ep = packet->hdr.base.ep;
-	int32_t num_iso = packet->hdr.u.cmd_submit.number_of_packets;
-	uint8_t xfer_type = get_xfer_type(dev, dir, ep);
+	struct flow_control_info *fc = &fwd_conf.flow_control;
+	struct flow_budget budget;
 
-	if (xfer_type != USB_ENDPOINT_XFER_ISOC)
-		num_iso = 0;
+	if (dev->info.udev.speed >= USB_SPEED_SUPER)
+		budget = fc->usb3;
+	else
+		budget = fc->usb2;
 
-	xfer = libusb_alloc_transfer(num_iso);
-	if (!xfer) {
-		rh_trace(LVL_DBG, "Can't allocate memory\n");
-		return false;
+	for (uint32_t i = 0; i < fc->class_count; i++) {
+		if (!device_has_class(dev, fc->classes[i].usb_class))
+			continue;
+		if (fc->classes[i].budget.byte_budget)
+			budget.byte_budget = fc->classes[i].budget.byte_budget;
+		if (fc->classes[i].budget.urb_limit)
+			budget.urb_limit = fc->classes[i].budget.urb_limit;
+		break;
 	}
 
-	packet->xfer = xfer;
-	xfer->buffer = data_buffer;
+	dev->fwd.budget = budget;
+	dev->fwd.bytes_queued = 0;
+	dev->fwd.urbs_queued = 0;
 
-	packet->xfer->endpoint		= set_endpoint(ep, dir);
-	packet->xfer->type		= xfer_type;
-	packet->xfer->timeout		= 0;
-	packet->xfer->user_data		= packet;
-	packet->xfer->length		= packet->hdr.u.cmd_submit.transfer_buffer_length + offset;
-	packet->xfer->callback		= xfer_completion_callback;
-	packet->xfer->num_iso_packets	= num_iso;
-	packet->xfer->flags		= 0; // TODO: Check flags
-	packet->xfer->dev_handle	= dev->fwd.handle;
+	rh_trace(LVL_DBG, "Flow budget %u bytes / %u URBs\n", budget.byte_budget, budget.urb_limit);
+}
 
-	if (packet->hdr.base.ep == 0)
-		intercept_control_packet(&dev->fwd, &packet->hdr);
+static void init_tx_coalesce(struct server_usb_device *dev)
+{
+	struct tx_coalesce_info *coalesce = &fwd_conf.tx_coalesce;
 
-	dump_packet(packet);
+	dev->fwd.coalesce = coalesce->policy;
 
-	if (num_iso > 0) {
-		ret = receive_iso(&dev->fwd, num_iso, xfer);
-		if (ret != 0) {
-			rh_trace(LVL_ERR, "ISO receive fail\n");
-			libusb_free_transfer(xfer);
-			return false;
-		}
+	for (uint32_t i = 0; i < coalesce->class_count; i++) {
+		if (!device_has_class(dev, coalesce->classes[i].usb_class))
+			continue;
+		dev->fwd.coalesce = coalesce->classes[i].policy;
+		break;
 	}
 
-	pthread_mutex_lock(&dev->fwd.buffer_lock);
+	if (dev->fwd.coalesce.enabled)
+		rh_trace(LVL_DBG, "TX coalescing %u us / %u bytes, types 0x%x\n",
+				  dev->fwd.coalesce.latency_us, dev->fwd.coalesce.max_bytes,
+				  dev->fwd.coalesce.ep_types);
+}
 
-	ret = libusb_submit_transfer(packet->xfer);
-	if (ret != 0) {
-		rh_trace(LVL_ERR, "Submit failed %s\n", libusb_strerror(ret));
-		libusb_free_transfer(xfer);
-		pthread_mutex_unlock(&dev->fwd.buffer_lock);
+/*
+ * Takes room for a packet of the given size. A packet larger than the whole
+ * byte budget is let through once nothing else is queued. Credits are only
+ * touched by the device handler.
+ */
+static bool take_credit(struct forward_info *f_dev, uint32_t bytes)
+{
+	if (f_dev->urbs_queued && (f_dev->urbs_queued >= f_dev->budget.urb_limit ||
+				   f_dev->bytes_queued + bytes > f_dev->budget.byte_budget))
 		return false;
-	}
 
-	enqueue_packet(&dev->fwd, packet);
-	pthread_mutex_unlock(&dev->fwd.buffer_lock);
+	f_dev->urbs_queued++;
+	f_dev->bytes_queued += bytes;
+
 	return true;
 }
 
+static void put_credit(struct forward_info *f_dev, uint32_t bytes)
+{
+	f_dev->urbs_queued--;
+	f_dev->bytes_queued -= bytes;
+}
+
+static uint8_t set_endpoint(uint8_t ep, uint32_t dir)
+{
+	if (ep == 0)
+		return 0;
+
+	if (dir == USBIP_DIR_IN)
+		ep |= USB_DIR_IN;
+
+	return ep;
+}
+
 static bool handle_unlink(struct server_usb_device *dev, struct usbip_header *hdr)
 {
 	bool found;
@@ -461,7 +1001,7 @@ static bool handle_unlink(struct server_usb_device *dev, struct usbip_header *hd
 
 	rh_trace(LVL_DBG, "Packet %u was not found for unlinking\n", unlink_target_seqnum);
 
-	packet = calloc(1, sizeof(struct usb_packet));
+	packet = pool_get_packet(&dev->fwd.pool);
 	if (!packet) {
 		rh_trace(LVL_DBG, "Can not allocate memory\n");
 		return false;
@@ -474,77 +1014,12 @@ static bool handle_unlink(struct server_usb_device *dev, struct usbip_header *hd
 	memcpy(&packet->hdr, hdr, sizeof(struct usbip_header));
 
 	packet->f_dev = &dev->fwd;
-	packet->f_dev->packets_ready++;
-	packet->ready = true;
 
-	pthread_mutex_lock(&dev->fwd.buffer_lock);
-	enqueue_packet(&dev->fwd, packet);
-	pthread_mutex_unlock(&dev->fwd.buffer_lock);
-	pthread_cond_signal(&dev->fwd.buffer_cond);
+	enqueue_ready_packet(&dev->fwd, packet);
 
 	return true;
 }
 
-static bool handle_submit(struct server_usb_device *dev, struct usbip_header *hdr)
-{
-	bool ok;
-	int offset;
-	struct usb_packet *packet;
-	uint8_t *data_buffer;
-	uint32_t bufsize = hdr->u.cmd_submit.transfer_buffer_length;
-
-	packet = calloc(1, sizeof(struct usb_packet));
-	if (!packet) {
-		rh_trace(LVL_DBG, "Can not allocate memory\n");
-		return false;
-	}
-
-	memcpy(&packet->hdr, hdr, sizeof(struct usbip_header));
-	packet->f_dev = &dev->fwd;
-
-	data_buffer = calloc(bufsize + 8, sizeof(uint8_t));
-	if (!data_buffer) {
-		rh_trace(LVL_DBG, "Can not allocate memory\n");
-		return false;
-	}
-
-	memcpy(data_buffer, hdr->u.cmd_submit.setup, 8);
-
-	switch (hdr->base.direction) {
-	case USBIP_DIR_IN:
-		rh_trace(LVL_DBG, "Direction: IN\n");
-		break;
-	case USBIP_DIR_OUT:
-		rh_trace(LVL_DBG, "Direction: OUT\n");
-		if (bufsize) {
-			offset = hdr->base.ep == 0 ? 8 : 0;
-			ok = network_recv_data(dev->fwd.link, &data_buffer[offset], bufsize);
-			if (!ok) {
-				rh_trace(LVL_ERR, "Failed to receive data\n");
-				free(data_buffer);
-				free(packet);
-				return false;
-			}
-		}
-		break;
-	default:
-		rh_trace(LVL_DBG, "Unknown direction\n");
-		free(data_buffer);
-		free(packet);
-		return false;
-	}
-
-	ok = submit_xfer(dev, packet, data_buffer);
-	if (!ok) {
-		rh_trace(LVL_ERR, "Failed to submit transfer\n");
-		free(data_buffer);
-		free(packet);
-		return false;
-	}
-
-	return ok;
-}
-
 static void usbip_base_header_to_host_endian(struct usbip_header *hdr)
 {
 	hdr->base.command = ntohl(hdr->base.command);
@@ -591,117 +1066,84 @@ static void usbip_ret_unlink_header_to_network_endian(struct usbip_header *hdr)
 	hdr->u.ret_unlink.status = ntohl(hdr->u.ret_unlink.status);
 }
 
-static void *rx_server(void *fwd_dev)
+/* Prepares the packet and transfer for the CMD_SUBMIT header in rx_hdr */
+static bool rx_start_submit(struct server_usb_device *dev)
 {
-	bool ok;
-	struct usbip_header hdr = {0};
-	struct server_usb_device *dev = (struct server_usb_device *)fwd_dev;
-
-	rh_trace(LVL_DBG, "Fwd RX started\n");
+	struct usbip_header *hdr = &dev->fwd.rx_hdr;
+	struct libusb_transfer *xfer;
+	struct usb_packet *packet;
+	uint8_t *data_buffer;
 
-	while (1) {
-		pthread_mutex_lock(&dev->fwd.buffer_lock);
-		while (dev->fwd.packets_ready >= PACKET_BUF_SIZE && !dev->fwd.terminate)
-			pthread_cond_wait(&dev->fwd.buffer_cond, &dev->fwd.buffer_lock);
+	uint32_t bufsize = hdr->u.cmd_submit.transfer_buffer_length;
+	uint32_t dir = hdr->base.direction;
+	uint8_t ep = hdr->base.ep;
+	int32_t num_iso = hdr->u.cmd_submit.number_of_packets;
+	uint8_t xfer_type = get_xfer_type(dev, dir, ep);
 
-		pthread_mutex_unlock(&dev->fwd.buffer_lock);
+	switch (dir) {
+	case USBIP_DIR_IN:
+		rh_trace(LVL_DBG, "Direction: IN\n");
+		break;
+	case USBIP_DIR_OUT:
+		rh_trace(LVL_DBG, "Direction: OUT\n");
+		break;
+	default:
+		rh_trace(LVL_DBG, "Unknown direction\n");
+		put_credit(&dev->fwd, bufsize + 8);
+		return false;
+	}
 
-		if (dev->fwd.terminate)
-			goto rx_exit;
+	if (xfer_type != USB_ENDPOINT_XFER_ISOC)
+		num_iso = 0;
 
-		ok = network_recv_data(dev->fwd.link, (uint8_t *)&hdr, sizeof(struct usbip_header));
-		if (!ok) {
-			rh_trace(LVL_DBG, "Header receive failed\n");
-			goto rx_exit;
-		}
+	packet = pool_get_packet(&dev->fwd.pool);
+	if (!packet) {
+		rh_trace(LVL_DBG, "Can not allocate memory\n");
+		put_credit(&dev->fwd, bufsize + 8);
+		return false;
+	}
 
-		usbip_base_header_to_host_endian(&hdr);
+	memcpy(&packet->hdr, hdr, sizeof(struct usbip_header));
+	packet->f_dev = &dev->fwd;
+	/* The credit is given back when the reply has been sent */
+	packet->credited = true;
+	packet->buf_size = bufsize + 8;
+	dev->fwd.rx_packet = packet;
 
-		switch (hdr.base.command) {
-		case USBIP_CMD_UNLINK:
-			usbip_cmd_unlink_header_to_host_endian(&hdr);
-			ok = handle_unlink(dev, &hdr);
-			if (!ok) {
-				rh_trace(LVL_ERR, "Unlink failed\n");
-				goto rx_exit;
-			}
-			break;
-		case USBIP_CMD_SUBMIT:
-			usbip_cmd_submit_header_to_host_endian(&hdr);
-			rh_trace(LVL_DBG, "Received SUBMIT packet seqnum %d\n", hdr.base.seqnum);
-			ok = handle_submit(dev, &hdr);
-			if (!ok) {
-				rh_trace(LVL_ERR, "Submit failed\n");
-				goto rx_exit;
-			}
-			break;
-		default:
-			rh_trace(LVL_ERR, "Unknown header\n");
-			goto rx_exit;
-		}
+	data_buffer = pool_get_buffer(&dev->fwd.pool, packet->buf_size);
+	if (!data_buffer) {
+		rh_trace(LVL_DBG, "Can not allocate memory\n");
+		return false;
 	}
-rx_exit:
-	rh_trace(LVL_DBG, "Fwd RX terminate\n");
-	dev->fwd.terminate = true;
-	pthread_cond_signal(&dev->fwd.buffer_cond);
-	return NULL;
-}
-
-static void fill_iso(struct libusb_iso_packet_descriptor libusb_iso,
-		     struct usbip_iso_packet_descriptor *iso, uint32_t offset)
-{
-	iso->offset = htonl(offset);
-	iso->status = htonl(convert_libusb_status(libusb_iso.status));
-	iso->length = htonl(libusb_iso.length);
-	iso->actual_length = htonl(libusb_iso.actual_length);
-}
 
-static bool send_iso_xfer_data(struct usb_packet *packet, uint32_t usb_direction)
-{
-	struct forward_info *f_dev = packet->f_dev;
-	struct usbip_iso_packet_descriptor iso;
-	uint32_t offset = 0, al = 0;
-	bool ok;
+	memcpy(data_buffer, hdr->u.cmd_submit.setup, 8);
 
-	if (usb_direction == USBIP_DIR_IN) {
-		for (int i = 0; i < packet->xfer->num_iso_packets; i++) {
-			ok = network_send_data(f_dev->link, &packet->xfer->buffer[offset],
-					       packet->xfer->iso_packet_desc[i].actual_length);
-			if (!ok) {
-				rh_trace(LVL_ERR, "ISO send failed\n");
-				return false;
-			}
-			al += packet->xfer->iso_packet_desc[i].actual_length;
-			offset += packet->xfer->iso_packet_desc[i].length;
-		}
-		rh_trace(LVL_DBG, "Sent iso data %d (offset %d)\n", al, offset);
+	xfer = pool_get_transfer(&dev->fwd.pool, num_iso);
+	if (!xfer) {
+		rh_trace(LVL_DBG, "Can't allocate memory\n");
+		pool_put_buffer(&dev->fwd.pool, data_buffer, packet->buf_size);
+		return false;
 	}
 
-	offset = 0;
-	for (int i = 0; i < packet->xfer->num_iso_packets; i++) {
-		fill_iso(packet->xfer->iso_packet_desc[i], &iso, offset);
-		ok = network_send_data(f_dev->link, (uint8_t *)&iso, 16UL);
-		if (!ok) {
-			rh_trace(LVL_ERR, "2nd ISO send failed\n");
-			return false;
-		}
-		offset += packet->xfer->iso_packet_desc[i].length;
-	}
-	return true;
-}
+	packet->xfer = xfer;
+	xfer->buffer = data_buffer;
 
-static bool send_xfer_data(struct usb_packet *packet, uint32_t usb_direction)
-{
-	bool ok;
-	uint32_t data_offset = (packet->xfer->endpoint & 0x7f) == 0 ? 8 : 0;
+	packet->xfer->endpoint		= set_endpoint(ep, dir);
+	packet->xfer->type		= xfer_type;
+	packet->xfer->timeout		= 0;
+	packet->xfer->user_data		= packet;
+	packet->xfer->length		= bufsize + (ep == 0 ? 8 : 0);
+	packet->xfer->callback		= xfer_completion_callback;
+	packet->xfer->num_iso_packets	= num_iso;
+	packet->xfer->flags		= 0; // TODO: Check flags
+	packet->xfer->dev_handle	= dev->fwd.handle;
 
-	if (usb_direction == USBIP_DIR_IN) {
-		ok = network_send_data(packet->f_dev->link, &packet->xfer->buffer[data_offset],
-				       packet->xfer->actual_length);
-		if (!ok) {
-			rh_trace(LVL_DBG, "Data send failed\n");
-			return false;
-		}
+	/* Bulk has no use for start_frame, stream tagged URBs carry the stream id there */
+	if (xfer_type == USB_ENDPOINT_XFER_BULK && hdr->u.cmd_submit.start_frame > 0 &&
+	    (uint32_t)hdr->u.cmd_submit.start_frame <= dev->fwd.streams &&
+	    stream_endpoint(&dev->fwd, packet->xfer->endpoint)) {
+		packet->xfer->type = LIBUSB_TRANSFER_TYPE_BULK_STREAM;
+		libusb_transfer_set_stream_id(packet->xfer, hdr->u.cmd_submit.start_frame);
 	}
 
 	return true;
@@ -709,218 +1151,1821 @@ static bool send_xfer_data(struct usb_packet *packet, uint32_t usb_direction)
 
 static void free_usb_packet(struct usb_packet *packet)
 {
+	struct packet_pool *pool = &packet->f_dev->pool;
+
 	if (packet->xfer && packet->xfer->buffer) {
-		free(packet->xfer->buffer);
+		pool_put_buffer(pool, packet->xfer->buffer, packet->buf_size);
 		packet->xfer->buffer = NULL;
 	}
 
 	if (packet->xfer) {
-		libusb_free_transfer(packet->xfer);
+		pool_put_transfer(pool, packet->xfer);
 		packet->xfer = NULL;
 	}
 
-	free(packet);
-}
-
-static void *tx_server(void *fwd_dev)
-{
-	bool ok;
-	uint32_t command, usb_direction;
-	struct server_usb_device *dev = (struct server_usb_device *)fwd_dev;
-	struct usb_packet *packet;
+	free(packet->iso_desc);
+	packet->iso_desc = NULL;
 
-	rh_trace(LVL_DBG, "Fwd TX started\n");
+	if (packet->credited)
+		put_credit(packet->f_dev, packet->buf_size);
 
-	while (1) {
-		pthread_mutex_lock(&dev->fwd.buffer_lock);
-		while (!dev->fwd.packets_ready && !dev->fwd.terminate)
-			pthread_cond_wait(&dev->fwd.buffer_cond, &dev->fwd.buffer_lock);
+	pool_put_packet(pool, packet);
+}
 
-		pthread_mutex_unlock(&dev->fwd.buffer_lock);
+/* Completes a standard descriptor read from the cache, the packet is not submitted */
+static bool answer_from_cache(struct forward_info *f_dev, struct usb_packet *packet)
+{
+	struct usb_ctrlrequest *req = (struct usb_ctrlrequest *)packet->hdr.u.cmd_submit.setup;
+	struct ep_queue *epq, *out;
+	struct desc_entry *entry;
+	uint32_t len;
+
+	if (!f_dev->desc_cache || packet->hdr.base.direction != USBIP_DIR_IN ||
+	    req->bRequestType != (USB_DIR_IN | USB_TYPE_STANDARD | USB_RECIP_DEVICE) ||
+	    req->bRequest != USB_REQ_GET_DESCRIPTOR)
+		return false;
 
-		if (dev->fwd.terminate)
-			goto tx_exit;
+	/* Requests already at the device are answered first, control writes included */
+	out = get_ep_queue(f_dev, USBIP_DIR_OUT, 0);
+	if (out->queued || out->backlog_head)
+		return false;
 
-		ok = dequeue_ready_packet(&dev->fwd, &packet);
-		if (!ok) {
-			rh_trace(LVL_ERR, "No packet available\n");
-			continue;
-		}
+	epq = get_ep_queue(f_dev, USBIP_DIR_IN, 0);
+	if (epq->queued || epq->backlog_head)
+		return false;
 
-		if (packet->unlinked) {
-			/* Successful unlink status is -ECONNRESET */
-			packet->hdr.base.command = USBIP_RET_UNLINK;
-			packet->hdr.u.ret_unlink.status = -ECONNRESET;
-			packet->hdr.base.seqnum = packet->unlinked;
-		}
+	entry = desc_cache_find(f_dev, libusb_le16_to_cpu(req->wValue),
+				libusb_le16_to_cpu(req->wIndex));
+	if (!entry)
+		return false;
 
-		command = packet->hdr.base.command;
-		usb_direction = packet->hdr.base.direction;
-		usbip_base_header_to_network_endian(&packet->hdr);
+	len = entry->len;
+	if (len > libusb_le16_to_cpu(req->wLength))
+		len = libusb_le16_to_cpu(req->wLength);
+	if (len > (uint32_t)packet->hdr.u.cmd_submit.transfer_buffer_length)
+		len = packet->hdr.u.cmd_submit.transfer_buffer_length;
 
-		if (command == USBIP_RET_SUBMIT) {
-			usbip_ret_submit_header_to_network_endian(&packet->hdr);
-		} else if (command == USBIP_RET_UNLINK) {
-			usbip_ret_unlink_header_to_network_endian(&packet->hdr);
-		} else {
-			rh_trace(LVL_DBG, "Unknown command 0x%x\n", command);
-			free_usb_packet(packet);
-			goto tx_exit;
-		}
+	memcpy(&packet->xfer->buffer[8], entry->data, len);
+	packet->xfer->actual_length = len;
 
-		ok = network_send_data(dev->fwd.link, (uint8_t *)&packet->hdr,
-					sizeof(struct usbip_header));
-		if (!ok) {
-			free_usb_packet(packet);
-			goto tx_exit;
-		}
+	packet->hdr.base.command = USBIP_RET_SUBMIT;
+	packet->hdr.u.ret_submit.status = 0;
+	packet->hdr.u.ret_submit.actual_length = len;
+	packet->hdr.u.ret_submit.start_frame = 0;
+	packet->hdr.u.ret_submit.number_of_packets = 0;
+	packet->hdr.u.ret_submit.error_count = 0;
 
-		if (command == USBIP_RET_SUBMIT) {
-			rh_trace(LVL_DBG, "Sending submit packet data\n");
-			if (packet->xfer->type == USB_ENDPOINT_XFER_ISOC)
-				ok = send_iso_xfer_data(packet, usb_direction);
-			else
-				ok = send_xfer_data(packet, usb_direction);
-			if (!ok) {
-				free_usb_packet(packet);
-				goto tx_exit;
-			}
-		} else if (command == USBIP_RET_UNLINK) {
-			rh_trace(LVL_DBG, "Unlink packet (no data to send)\n");
-		}
+	/* Accounted on the endpoint queue, an unlink finds it as already done */
+	packet->ep_queue = epq;
+	packet->submitted = true;
+	packet->answered = true;
+	epq->queued++;
+	inflight_insert(f_dev, packet);
+	enqueue_ready_packet(f_dev, packet);
 
-		free_usb_packet(packet);
-	}
-tx_exit:
-	rh_trace(LVL_DBG, "Fwd TX terminate\n");
-	dev->fwd.terminate = true;
-	pthread_cond_signal(&dev->fwd.buffer_cond);
-	return NULL;
+	return true;
 }
 
-static void inform_exported(struct usbip_usb_device dev)
+/* Not counted on the endpoint queue, the client has not asked for it yet */
+static bool submit_speculative(struct forward_info *f_dev, struct usb_packet *packet)
 {
-	struct rh_event event = {0};
+	int ret;
 
-	event.type = EVENT_DEVICE_EXPORTED;
-	event.data = &dev;
-	event.size = sizeof(dev);
-	(void) event_enqueue(&event);
-}
+	__atomic_store_n(&packet->ready, false, __ATOMIC_RELAXED);
+	packet->submitted = true;
+	__atomic_add_fetch(&f_dev->packets_inflight, 1, __ATOMIC_RELAXED);
 
-static void inform_unexported(struct usbip_usb_device dev)
-{
-	struct rh_event event = {0};
+	ret = libusb_submit_transfer(packet->xfer);
+	if (ret != 0) {
+		__atomic_sub_fetch(&f_dev->packets_inflight, 1, __ATOMIC_RELAXED);
+		packet->submitted = false;
+		rh_trace(LVL_DBG, "Prefetch submit failed %s\n", libusb_strerror(ret));
+		return false;
+	}
 
-	event.type = EVENT_DEVICE_UNEXPORTED;
-	event.data = &dev;
-	event.size = sizeof(dev);
-	(void) event_enqueue(&event);
+	return true;
 }
 
-static void *monitor(void *f_device)
+static struct usb_packet *alloc_speculative(struct server_usb_device *dev, uint8_t epnum,
+					    uint8_t type, uint32_t length)
 {
-	int ret;
-	pthread_t rx_thread, tx_thread;
+	struct packet_pool *pool = &dev->fwd.pool;
 	struct usb_packet *packet;
-	struct server_usb_device *dev = (struct server_usb_device *)f_device;
 
-	inform_exported(dev->info.udev);
+	packet = pool_get_packet(pool);
+	if (!packet)
+		return NULL;
 
-	pthread_mutex_init(&dev->fwd.buffer_lock, NULL);
-	pthread_cond_init(&dev->fwd.buffer_cond, NULL);
+	packet->f_dev = &dev->fwd;
+	packet->speculative = true;
+	packet->buf_size = length;
+	packet->hdr.base.direction = USBIP_DIR_IN;
+	packet->hdr.base.ep = epnum;
 
-	if (pthread_create(&rx_thread, NULL, rx_server, dev)) {
-		rh_trace(LVL_DBG, "RX Create failed\n");
-		release_device(dev);
-		inform_unexported(dev->info.udev);
-		dev->fwd.terminate = true;
+	packet->xfer = pool_get_transfer(pool, 0);
+	if (!packet->xfer) {
+		free_usb_packet(packet);
 		return NULL;
 	}
 
-	if (pthread_create(&tx_thread, NULL, tx_server, dev)) {
-		rh_trace(LVL_DBG, "TX Create failed\n");
-		release_device(dev);
-		inform_unexported(dev->info.udev);
-		dev->fwd.terminate = true;
-		pthread_join(rx_thread, NULL);
+	packet->xfer->buffer = pool_get_buffer(pool, length);
+	if (!packet->xfer->buffer) {
+		free_usb_packet(packet);
 		return NULL;
 	}
 
-	pthread_join(rx_thread, NULL);
-	pthread_join(tx_thread, NULL);
+	packet->xfer->endpoint		= set_endpoint(epnum, USBIP_DIR_IN);
+	packet->xfer->type		= type;
+	packet->xfer->timeout		= 0;
+	packet->xfer->user_data		= packet;
+	packet->xfer->length		= length;
+	packet->xfer->callback		= xfer_completion_callback;
+	packet->xfer->num_iso_packets	= 0;
+	packet->xfer->flags		= 0;
+	packet->xfer->dev_handle	= dev->fwd.handle;
+
+	return packet;
+}
 
-	// Destroy all of the data
-	while (dequeue_any_packet(&dev->fwd, &packet)) {
-		pthread_mutex_lock(&dev->fwd.buffer_lock);
-		if (!packet->ready) {
-			ret = libusb_cancel_transfer(packet->xfer);
-			if (ret)
-				rh_trace(LVL_ERR, "Cancel transfer failed with %d\n", ret);
-			while (!packet->ready) {
-				pthread_mutex_unlock(&dev->fwd.buffer_lock);
-				rh_trace(LVL_DBG, "Waiting for completion\n");
-				usleep(10000);
-				pthread_mutex_lock(&dev->fwd.buffer_lock);
-			}
-		}
-		pthread_mutex_unlock(&dev->fwd.buffer_lock);
-		if (packet->xfer) {
-			if (packet->xfer->buffer)
-				free(packet->xfer->buffer);
-			libusb_free_transfer(packet->xfer);
-		}
-		free(packet);
-	}
+/* Fills the ring of the endpoint, false when nothing could be submitted */
+static bool prefetch_start(struct server_usb_device *dev, struct int_prefetch *pf,
+			   uint8_t epnum, uint32_t length)
+{
+	uint32_t depth = fwd_conf.int_prefetch;
+	struct usb_packet *spec;
 
-	release_device(dev);
-	libusb_close(dev->fwd.handle);
+	if (depth > PREFETCH_MAX_DEPTH)
+		depth = PREFETCH_MAX_DEPTH;
 
-	pthread_cond_destroy(&dev->fwd.buffer_cond);
-	pthread_mutex_destroy(&dev->fwd.buffer_lock);
-	dev->fwd.packets_ready = 0;
+	pf->length = length;
+	for (uint32_t i = 0; i < depth; i++) {
+		if (pf->spec[i])
+			continue;
 
-	network_close_link(dev->fwd.link);
-	free(dev->fwd.link);
-	dev->fwd.link = NULL;
+		spec = alloc_speculative(dev, epnum, USB_ENDPOINT_XFER_INT, length);
+		if (!spec)
+			break;
 
-	inform_unexported(dev->info.udev);
-	rh_trace(LVL_TRC, "Monitor exit\n");
+		if (!submit_speculative(&dev->fwd, spec)) {
+			free_usb_packet(spec);
+			break;
+		}
 
-	return NULL;
+		pf->spec[i] = spec;
+		pf->count++;
+	}
+
+	if (!pf->count)
+		pf->length = 0;
+
+	return pf->count > 0;
 }
 
-bool forwarding_start(struct server_usb_device *dev)
+/* Reads still waiting when their read ahead has stopped go to the device after all */
+static void release_parked(struct forward_info *f_dev, struct usb_packet **head,
+			   struct usb_packet **tail)
 {
+	struct usb_packet *packet;
+	struct ep_queue *epq;
 	int ret;
-	bool ok;
 
-	if (dev->info.udev.bNumConfigurations != 1) {
-		rh_trace(LVL_ERR, "Only single config devices supported!\n");
-		return false;
-	}
+	while ((packet = fifo_pop(head, tail))) {
+		packet->parked = false;
+		epq = get_ep_queue(f_dev, USBIP_DIR_IN, packet->hdr.base.ep);
+		packet->ep_queue = epq;
 
-	ret = libusb_open(dev->fwd.libusb_dev, &dev->fwd.handle);
-	if (ret < 0) {
+		if (epq->backlog_head || epq->queued >= epq->depth) {
+			backlog_append(f_dev, packet);
+			continue;
+		}
+
+		ret = submit_packet(f_dev, packet);
+		if (ret != 0) {
+			rh_trace(LVL_ERR, "Submit failed %s\n", libusb_strerror(ret));
+			/* The packet stays in the table and is freed at teardown */
+			f_dev->terminate = true;
+		}
+	}
+}
+
+static void prefetch_drop(struct forward_info *f_dev, struct int_prefetch *pf,
+			  struct usb_packet *spec)
+{
+	for (int i = 0; i < PREFETCH_MAX_DEPTH; i++) {
+		if (pf->spec[i] == spec)
+			pf->spec[i] = NULL;
+	}
+	free_usb_packet(spec);
+
+	if (--pf->count)
+		return;
+
+	/* The next read starts the ring again */
+	pf->length = 0;
+	if (!f_dev->terminate)
+		release_parked(f_dev, &pf->wait_head, &pf->wait_tail);
+}
+
+/* Completes the client read with the report and reads the next one in its place */
+static void prefetch_deliver(struct forward_info *f_dev, struct int_prefetch *pf,
+			     struct usb_packet *packet, struct usb_packet *report)
+{
+	uint32_t len = report->xfer->actual_length;
+
+	if (len > (uint32_t)packet->hdr.u.cmd_submit.transfer_buffer_length)
+		len = packet->hdr.u.cmd_submit.transfer_buffer_length;
+
+	memcpy(packet->xfer->buffer, report->xfer->buffer, len);
+	packet->xfer->actual_length = len;
+
+	packet->hdr.base.command = USBIP_RET_SUBMIT;
+	packet->hdr.u.ret_submit.status = report->hdr.u.ret_submit.status;
+	packet->hdr.u.ret_submit.actual_length = len;
+	packet->hdr.u.ret_submit.start_frame = 0;
+	packet->hdr.u.ret_submit.number_of_packets = 0;
+	packet->hdr.u.ret_submit.error_count = 0;
+
+	/* An unlink finds it as already done */
+	packet->submitted = true;
+	packet->answered = true;
+	enqueue_ready_packet(f_dev, packet);
+
+	/* An endpoint in error is not polled on, the client decides what next */
+	if (report->hdr.u.ret_submit.status || f_dev->terminate ||
+	    !submit_speculative(f_dev, report))
+		prefetch_drop(f_dev, pf, report);
+}
+
+/*
+ * With "interrupt_prefetch" set, interrupt IN endpoints are kept read
+ * ahead of the client. A client read is then answered with a report that
+ * has already arrived, or with the next one, without its own round trip to
+ * the device. Returns false when the read goes to the device as usual.
+ */
+static bool prefetch_read(struct server_usb_device *dev, struct usb_packet *packet)
+{
+	struct forward_info *f_dev = &dev->fwd;
+	uint32_t length = packet->hdr.u.cmd_submit.transfer_buffer_length;
+	uint8_t epnum = packet->hdr.base.ep & USB_ENDPOINT_NUMBER_MASK;
+	struct int_prefetch *pf = &f_dev->prefetch[epnum];
+	struct usb_packet *report;
+
+	if (!fwd_conf.int_prefetch || packet->hdr.base.direction != USBIP_DIR_IN ||
+	    packet->xfer->type != USB_ENDPOINT_XFER_INT || !length)
+		return false;
+
+	/* The ring is sized by the first read, reads of another size skip it */
+	if (pf->length && pf->length != length)
+		return false;
+
+	if (!pf->length && !prefetch_start(dev, pf, epnum, length))
+		return false;
+
+	inflight_insert(f_dev, packet);
+
+	report = fifo_pop(&pf->held_head, &pf->held_tail);
+	if (!report) {
+		packet->parked = true;
+		fifo_push(&pf->wait_head, &pf->wait_tail, packet);
+		return true;
+	}
+
+	prefetch_deliver(f_dev, pf, packet, report);
+
+	return true;
+}
+
+/* A read ahead has completed, taken from the ready list */
+static void prefetch_complete(struct forward_info *f_dev, struct usb_packet *report)
+{
+	struct int_prefetch *pf = &f_dev->prefetch[report->hdr.base.ep];
+	struct usb_packet *packet;
+
+	report->submitted = false;
+
+	/* The teardown frees the ring */
+	if (f_dev->terminate)
+		return;
+
+	packet = fifo_pop(&pf->wait_head, &pf->wait_tail);
+	if (!packet) {
+		fifo_push(&pf->held_head, &pf->held_tail, report);
+		return;
+	}
+
+	packet->parked = false;
+	prefetch_deliver(f_dev, pf, packet, report);
+}
+
+static void prefetch_cancel(struct forward_info *f_dev)
+{
+	struct usb_packet *spec;
+	int ret;
+
+	for (int ep = 0; ep < 16; ep++) {
+		for (int i = 0; i < PREFETCH_MAX_DEPTH; i++) {
+			spec = f_dev->prefetch[ep].spec[i];
+			if (!spec || !spec->submitted ||
+			    __atomic_load_n(&spec->ready, __ATOMIC_RELAXED))
+				continue;
+			ret = libusb_cancel_transfer(spec->xfer);
+			if (ret && ret != LIBUSB_ERROR_NOT_FOUND)
+				rh_trace(LVL_ERR, "Cancel transfer failed with %d\n", ret);
+		}
+	}
+}
+
+/* Waiting reads are in the inflight table and freed with it */
+static void prefetch_free(struct forward_info *f_dev)
+{
+	for (int ep = 0; ep < 16; ep++) {
+		for (int i = 0; i < PREFETCH_MAX_DEPTH; i++) {
+			if (f_dev->prefetch[ep].spec[i])
+				free_usb_packet(f_dev->prefetch[ep].spec[i]);
+		}
+	}
+
+	memset(f_dev->prefetch, 0, sizeof(f_dev->prefetch));
+}
+
+/* Finds the bulk-only mass storage interface and its bulk endpoints */
+static void bot_setup(struct server_usb_device *dev)
+{
+	const struct libusb_interface_descriptor *alt;
+	const struct libusb_endpoint_descriptor *ep;
+	struct libusb_config_descriptor *config;
+	struct bot_readahead *bot = &dev->fwd.bot;
+	int intf = -1;
+
+	memset(bot, 0, sizeof(*bot));
+	if (!fwd_conf.bot_readahead)
+		return;
+
+	for (int i = 0; i < dev->info.udev.bNumInterfaces && i < RH_MAX_USB_INTERFACES; i++) {
+		if (dev->info.interface[i].bInterfaceClass == USB_CLASS_MASS_STORAGE &&
+		    dev->info.interface[i].bInterfaceProtocol == USB_PR_BULK) {
+			intf = i;
+			break;
+		}
+	}
+
+	if (intf < 0)
+		return;
+
+	if (libusb_get_active_config_descriptor(libusb_get_device(dev->fwd.handle), &config))
+		return;
+
+	if (intf < config->bNumInterfaces && config->interface[intf].num_altsetting) {
+		alt = &config->interface[intf].altsetting[0];
+		for (int i = 0; i < alt->bNumEndpoints; i++) {
+			ep = &alt->endpoint[i];
+			if ((ep->bmAttributes & USB_ENDPOINT_XFERTYPE_MASK) !=
+			    USB_ENDPOINT_XFER_BULK)
+				continue;
+			if (ep->bEndpointAddress & USB_DIR_IN)
+				bot->in_ep = ep->bEndpointAddress & USB_ENDPOINT_NUMBER_MASK;
+			else
+				bot->out_ep = ep->bEndpointAddress & USB_ENDPOINT_NUMBER_MASK;
+		}
+	}
+	libusb_free_config_descriptor(config);
+
+	if (!bot->in_ep || !bot->out_ep) {
+		bot->in_ep = 0;
+		bot->out_ep = 0;
+		return;
+	}
+
+	rh_trace(LVL_DBG, "Reading ahead on mass storage interface %d\n", intf);
+}
+
+/* Data length of a READ command wrapper sent by the client, 0 for anything else */
+static uint32_t bot_read_length(struct forward_info *f_dev, struct usb_packet *packet)
+{
+	struct bot_readahead *bot = &f_dev->bot;
+	uint8_t *cbw = packet->xfer->buffer;
+	uint32_t signature, length;
+
+	if (!bot->out_ep || packet->hdr.base.direction != USBIP_DIR_OUT ||
+	    packet->hdr.base.ep != bot->out_ep ||
+	    packet->hdr.u.cmd_submit.transfer_buffer_length != BOT_CBW_LEN)
+		return 0;
+
+	signature = cbw[0] | cbw[1] << 8 | cbw[2] << 16 | (uint32_t)cbw[3] << 24;
+	length = cbw[8] | cbw[9] << 8 | cbw[10] << 16 | (uint32_t)cbw[11] << 24;
+
+	if (signature != BOT_CBW_SIGNATURE || !(cbw[12] & BOT_CBW_FLAG_IN) ||
+	    (cbw[15] != SCSI_READ_10 && cbw[15] != SCSI_READ_16))
+		return 0;
+
+	if (length > BOT_MAX_READAHEAD)
+		return 0;
+
+	return length;
+}
+
+static void bot_cancel(struct usb_packet *spec)
+{
+	int ret;
+
+	if (!spec || !spec->submitted || __atomic_load_n(&spec->ready, __ATOMIC_RELAXED))
+		return;
+
+	ret = libusb_cancel_transfer(spec->xfer);
+	if (ret && ret != LIBUSB_ERROR_NOT_FOUND)
+		rh_trace(LVL_ERR, "Cancel transfer failed with %d\n", ret);
+}
+
+/*
+ * The command has gone to the device. Its data and status are read right
+ * behind it, the device answers them while the client is still being told
+ * that the command was sent.
+ */
+static void bot_start(struct server_usb_device *dev, uint32_t length)
+{
+	struct forward_info *f_dev = &dev->fwd;
+	struct bot_readahead *bot = &f_dev->bot;
+	struct ep_queue *epq = get_ep_queue(f_dev, USBIP_DIR_IN, bot->in_ep);
+
+	/* Nothing of the client may be ahead of them at the device */
+	if (bot->phase != BOT_IDLE || bot->data || bot->csw || epq->queued || epq->backlog_head)
+		return;
+
+	bot->data = alloc_speculative(dev, bot->in_ep, USB_ENDPOINT_XFER_BULK, length);
+	bot->csw = alloc_speculative(dev, bot->in_ep, USB_ENDPOINT_XFER_BULK, BOT_CSW_LEN);
+	if (!bot->data || !bot->csw || !submit_speculative(f_dev, bot->data))
+		goto err;
+
+	if (!submit_speculative(f_dev, bot->csw)) {
+		free_usb_packet(bot->csw);
+		bot->csw = NULL;
+		/* Freed once it is back */
+		bot_cancel(bot->data);
+		return;
+	}
+
+	bot->taken = 0;
+	bot->phase = BOT_DATA;
+	return;
+
+err:
+	if (bot->data)
+		free_usb_packet(bot->data);
+	if (bot->csw)
+		free_usb_packet(bot->csw);
+	bot->data = NULL;
+	bot->csw = NULL;
+}
+
+static void bot_reply(struct forward_info *f_dev, struct usb_packet *packet,
+		      struct usb_packet *spec, uint32_t offset, uint32_t len, int32_t status)
+{
+	memcpy(packet->xfer->buffer, spec->xfer->buffer + offset, len);
+	packet->xfer->actual_length = len;
+
+	packet->hdr.base.command = USBIP_RET_SUBMIT;
+	packet->hdr.u.ret_submit.status = status;
+	packet->hdr.u.ret_submit.actual_length = len;
+	packet->hdr.u.ret_submit.start_frame = 0;
+	packet->hdr.u.ret_submit.number_of_packets = 0;
+	packet->hdr.u.ret_submit.error_count = 0;
+
+	/* An unlink finds it as already done */
+	packet->parked = false;
+	packet->submitted = true;
+	packet->answered = true;
+	enqueue_ready_packet(f_dev, packet);
+}
+
+/* Reads ahead that are back and no longer wanted */
+static void bot_reap(struct bot_readahead *bot)
+{
+	if (bot->data && !bot->data->submitted && bot->phase != BOT_DATA) {
+		free_usb_packet(bot->data);
+		bot->data = NULL;
+	}
+
+	if (bot->csw && !bot->csw->submitted && bot->phase == BOT_IDLE) {
+		free_usb_packet(bot->csw);
+		bot->csw = NULL;
+	}
+}
+
+/* Answers the waiting reads in order, the data in as many parts as the client reads it in */
+static void bot_serve(struct forward_info *f_dev)
+{
+	struct bot_readahead *bot = &f_dev->bot;
+	struct usb_packet *packet, *data;
+	uint32_t want, len;
+	int32_t status;
+
+	while (bot->phase != BOT_IDLE && bot->wait_head) {
+		packet = bot->wait_head;
+		want = packet->hdr.u.cmd_submit.transfer_buffer_length;
+
+		if (bot->phase == BOT_DATA) {
+			data = bot->data;
+			if (data->submitted)
+				break;
+
+			len = data->xfer->actual_length - bot->taken;
+			if (len > want)
+				len = want;
+
+			/* The last part carries the status of the read */
+			status = 0;
+			if (bot->taken + len == (uint32_t)data->xfer->actual_length)
+				status = data->hdr.u.ret_submit.status;
+
+			fifo_pop(&bot->wait_head, &bot->wait_tail);
+			bot_reply(f_dev, packet, data, bot->taken, len, status);
+			bot->taken += len;
+			if (bot->taken < (uint32_t)data->xfer->actual_length)
+				continue;
+
+			/* After a stall the client clears the halt and reads the status itself */
+			bot->phase = status ? BOT_IDLE : BOT_STATUS;
+			if (status)
+				bot_cancel(bot->csw);
+			continue;
+		}
+
+		if (want != BOT_CSW_LEN) {
+			bot->phase = BOT_IDLE;
+			bot_cancel(bot->csw);
+			break;
+		}
+
+		if (bot->csw->submitted)
+			break;
+
+		fifo_pop(&bot->wait_head, &bot->wait_tail);
+		bot_reply(f_dev, packet, bot->csw, 0, bot->csw->xfer->actual_length,
+			  bot->csw->hdr.u.ret_submit.status);
+		bot->phase = BOT_IDLE;
+	}
+
+	bot_reap(bot);
+
+	if (bot->phase == BOT_IDLE && !f_dev->terminate)
+		release_parked(f_dev, &bot->wait_head, &bot->wait_tail);
+}
+
+/* A reset or an unlink, the device no longer answers what was read ahead */
+static void bot_stop(struct forward_info *f_dev)
+{
+	struct bot_readahead *bot = &f_dev->bot;
+
+	bot->stale = false;
+	bot->phase = BOT_IDLE;
+	bot_cancel(bot->data);
+	bot_cancel(bot->csw);
+	bot_serve(f_dev);
+}
+
+/*
+ * With "storage_readahead" set, the client reads of the data and status of
+ * a READ command are answered from reads made as soon as the command was
+ * sent. Returns false when the read goes to the device as usual.
+ */
+static bool bot_read(struct forward_info *f_dev, struct usb_packet *packet)
+{
+	struct bot_readahead *bot = &f_dev->bot;
+
+	if (bot->phase == BOT_IDLE || packet->hdr.base.direction != USBIP_DIR_IN ||
+	    packet->hdr.base.ep != bot->in_ep || !packet->hdr.u.cmd_submit.transfer_buffer_length)
+		return false;
+
+	inflight_insert(f_dev, packet);
+	packet->parked = true;
+	fifo_push(&bot->wait_head, &bot->wait_tail, packet);
+	bot_serve(f_dev);
+
+	return true;
+}
+
+/* A read ahead has completed, taken from the ready list */
+static void bot_complete(struct forward_info *f_dev, struct usb_packet *spec)
+{
+	spec->submitted = false;
+
+	/* The teardown frees it */
+	if (f_dev->terminate)
+		return;
+
+	bot_serve(f_dev);
+}
+
+/* Waiting reads are in the inflight table and freed with it */
+static void bot_free(struct forward_info *f_dev)
+{
+	if (f_dev->bot.data)
+		free_usb_packet(f_dev->bot.data);
+	if (f_dev->bot.csw)
+		free_usb_packet(f_dev->bot.csw);
+
+	f_dev->bot.data = NULL;
+	f_dev->bot.csw = NULL;
+	f_dev->bot.phase = BOT_IDLE;
+}
+
+/* Submits the fully received packet, or queues it behind its endpoint */
+static bool rx_finish_submit(struct server_usb_device *dev)
+{
+	struct usb_packet *packet = dev->fwd.rx_packet;
+	uint32_t read_length;
+	struct ep_queue *epq;
+	int ret;
+
+	if (packet->hdr.base.ep == 0) {
+		if (answer_from_cache(&dev->fwd, packet)) {
+			dev->fwd.rx_packet = NULL;
+			return true;
+		}
+		intercept_control_packet(&dev->fwd, &packet->hdr);
+	}
+
+	dump_packet(packet);
+
+	if (dev->fwd.bot.stale)
+		bot_stop(&dev->fwd);
+
+	if (prefetch_read(dev, packet) || bot_read(&dev->fwd, packet)) {
+		dev->fwd.rx_packet = NULL;
+		return true;
+	}
+	read_length = bot_read_length(&dev->fwd, packet);
+
+	epq = get_ep_queue(&dev->fwd, packet->hdr.base.direction, packet->hdr.base.ep);
+	packet->ep_queue = epq;
+
+	/* Keep the endpoint order, others are not held up by a full endpoint */
+	if (epq->backlog_head || epq->queued >= epq->depth) {
+		rh_trace(LVL_DBG, "Endpoint 0x%x full, backlogging\n", packet->xfer->endpoint);
+		backlog_append(&dev->fwd, packet);
+		inflight_insert(&dev->fwd, packet);
+		dev->fwd.rx_packet = NULL;
+		return true;
+	}
+
+	ret = submit_packet(&dev->fwd, packet);
+	if (ret != 0) {
+		rh_trace(LVL_ERR, "Submit failed %s\n", libusb_strerror(ret));
+		return false;
+	}
+
+	inflight_insert(&dev->fwd, packet);
+	dev->fwd.rx_packet = NULL;
+
+	if (read_length)
+		bot_start(dev, read_length);
+
+	return true;
+}
+
+/* Moves on to the payload the command still has, or submits it */
+static enum rx_result rx_payload_next(struct server_usb_device *dev)
+{
+	struct usb_packet *packet = dev->fwd.rx_packet;
+
+	if (dev->fwd.rx_state < RX_DATA && packet->hdr.base.direction == USBIP_DIR_OUT &&
+	    packet->hdr.u.cmd_submit.transfer_buffer_length) {
+		dev->fwd.rx_state = RX_DATA;
+		return RX_DONE;
+	}
+
+	if (dev->fwd.rx_state < RX_ISO && packet->xfer->num_iso_packets) {
+		dev->fwd.rx_state = RX_ISO;
+		return RX_DONE;
+	}
+
+	dev->fwd.rx_state = RX_HEADER;
+	if (!rx_finish_submit(dev)) {
+		rh_trace(LVL_ERR, "Failed to submit transfer\n");
+		return RX_FAIL;
+	}
+
+	return RX_DONE;
+}
+
+static enum rx_result rx_header(struct server_usb_device *dev)
+{
+	struct usbip_header *hdr = &dev->fwd.rx_hdr;
+	enum rx_result res;
+
+	res = rx_fill(&dev->fwd, (uint8_t *)hdr, sizeof(struct usbip_header));
+	if (res != RX_DONE)
+		return res;
+
+	usbip_base_header_to_host_endian(hdr);
+
+	switch (hdr->base.command) {
+	case USBIP_CMD_UNLINK:
+		usbip_cmd_unlink_header_to_host_endian(hdr);
+		if (!handle_unlink(dev, hdr)) {
+			rh_trace(LVL_ERR, "Unlink failed\n");
+			return RX_FAIL;
+		}
+		return RX_DONE;
+	case USBIP_CMD_SUBMIT:
+		usbip_cmd_submit_header_to_host_endian(hdr);
+		rh_trace(LVL_DBG, "Received SUBMIT packet seqnum %d\n", hdr->base.seqnum);
+		dev->fwd.rx_state = RX_CREDIT;
+		return RX_DONE;
+	default:
+		rh_trace(LVL_ERR, "Unknown header\n");
+		return RX_FAIL;
+	}
+}
+
+static enum rx_result rx_credit(struct server_usb_device *dev)
+{
+	int32_t len = dev->fwd.rx_hdr.u.cmd_submit.transfer_buffer_length;
+	int32_t num_iso = dev->fwd.rx_hdr.u.cmd_submit.number_of_packets;
+
+	/*
+	 * Checked before the charge, a bogus length would wrap it. Anything
+	 * larger than the byte budget is still fine, it waits for an idle
+	 * device and takes the whole budget.
+	 */
+	if (len < 0 || len > INT32_MAX - 8) {
+		rh_trace(LVL_ERR, "Invalid transfer length %d\n", len);
+		return RX_FAIL;
+	}
+
+	/* Sizes the transfer and the descriptor read, a bogus count would overflow both */
+	if (num_iso < 0 || num_iso > USBIP_MAX_ISO_PACKETS) {
+		rh_trace(LVL_ERR, "Invalid number of ISO packets %d\n", num_iso);
+		return RX_FAIL;
+	}
+
+	if (!take_credit(&dev->fwd, len + 8))
+		return RX_AGAIN;
+
+	if (!rx_start_submit(dev)) {
+		rh_trace(LVL_ERR, "Submit failed\n");
+		return RX_FAIL;
+	}
+
+	return rx_payload_next(dev);
+}
+
+static enum rx_result rx_data(struct server_usb_device *dev)
+{
+	struct usb_packet *packet = dev->fwd.rx_packet;
+	int offset = packet->hdr.base.ep == 0 ? 8 : 0;
+	enum rx_result res;
+
+	res = rx_fill(&dev->fwd, &packet->xfer->buffer[offset],
+		      packet->hdr.u.cmd_submit.transfer_buffer_length);
+	if (res != RX_DONE)
+		return res;
+
+	return rx_payload_next(dev);
+}
+
+static enum rx_result rx_iso(struct server_usb_device *dev)
+{
+	struct libusb_transfer *xfer = dev->fwd.rx_packet->xfer;
+	struct usbip_iso_packet_descriptor *usbip_iso, tmp_iso;
+	uint32_t len = xfer->num_iso_packets * sizeof(struct usbip_iso_packet_descriptor);
+	enum rx_result res;
+
+	/* The scratch keeps its contents, a partial read continues where it was */
+	usbip_iso = (struct usbip_iso_packet_descriptor *)
+		pool_get_scratch(&dev->fwd.pool, POOL_SCRATCH_RX_ISO, len);
+	if (!usbip_iso) {
+		rh_trace(LVL_ERR, "Can't allocate memory\n");
+		return RX_FAIL;
+	}
+
+	res = rx_fill(&dev->fwd, (uint8_t *)usbip_iso, len);
+	if (res != RX_DONE)
+		return res;
+
+	for (int i = 0; i < xfer->num_iso_packets; i++) {
+		tmp_iso = usbip_iso[i];
+		xfer->iso_packet_desc[i].length = ntohl(tmp_iso.length);
+		xfer->iso_packet_desc[i].actual_length = ntohl(tmp_iso.actual_length);
+		xfer->iso_packet_desc[i].status = ntohl(tmp_iso.status);
+	}
+
+	return rx_payload_next(dev);
+}
+
+/* Parses commands until the link runs dry or the credits run out */
+static bool rx_step(struct server_usb_device *dev)
+{
+	enum rx_result res;
+	bool progress = false;
+
+	while (!dev->fwd.terminate) {
+		switch (dev->fwd.rx_state) {
+		case RX_HEADER:
+			res = rx_header(dev);
+			break;
+		case RX_CREDIT:
+			res = rx_credit(dev);
+			break;
+		case RX_DATA:
+			res = rx_data(dev);
+			break;
+		case RX_ISO:
+			res = rx_iso(dev);
+			break;
+		default:
+			res = RX_FAIL;
+			break;
+		}
+
+		if (res == RX_AGAIN)
+			break;
+
+		if (res == RX_FAIL) {
+			rh_trace(LVL_DBG, "Fwd RX terminate\n");
+			dev->fwd.terminate = true;
+			break;
+		}
+
+		progress = true;
+	}
+
+	return progress;
+}
+
+static void fill_iso(struct libusb_iso_packet_descriptor libusb_iso,
+		     struct usbip_iso_packet_descriptor *iso, uint32_t offset)
+{
+	iso->offset = htonl(offset);
+	iso->status = htonl(convert_libusb_status(libusb_iso.status));
+	iso->length = htonl(libusb_iso.length);
+	iso->actual_length = htonl(libusb_iso.actual_length);
+}
+
+/* Entries needed for the reply header, data and ISO descriptors */
+static int reply_iov_count(struct usb_packet *packet, uint32_t command)
+{
+	if (command != USBIP_RET_SUBMIT)
+		return 1;
+
+	if (packet->xfer->type == USB_ENDPOINT_XFER_ISOC)
+		return packet->xfer->num_iso_packets + 2;
+
+	return 2;
+}
+
+static int fill_iso_iov(struct usb_packet *packet, uint32_t usb_direction, struct iovec *iov)
+{
+	struct libusb_transfer *xfer = packet->xfer;
+	uint32_t offset = 0, al = 0;
+	int iovcnt = 0;
+
+	if (usb_direction == USBIP_DIR_IN) {
+		for (int i = 0; i < xfer->num_iso_packets; i++) {
+			iov[iovcnt].iov_base = &xfer->buffer[offset];
+			iov[iovcnt].iov_len = xfer->iso_packet_desc[i].actual_length;
+			iovcnt++;
+			al += xfer->iso_packet_desc[i].actual_length;
+			offset += xfer->iso_packet_desc[i].length;
+		}
+		rh_trace(LVL_DBG, "Sending iso data %d (offset %d)\n", al, offset);
+	}
+
+	offset = 0;
+	for (int i = 0; i < xfer->num_iso_packets; i++) {
+		fill_iso(xfer->iso_packet_desc[i], &packet->iso_desc[i], offset);
+		offset += xfer->iso_packet_desc[i].length;
+	}
+
+	iov[iovcnt].iov_base = packet->iso_desc;
+	iov[iovcnt].iov_len = xfer->num_iso_packets * sizeof(struct usbip_iso_packet_descriptor);
+	iovcnt++;
+
+	return iovcnt;
+}
+
+/* Builds the whole reply of a packet, returns the amount of entries used */
+static int fill_reply_iov(struct usb_packet *packet, uint32_t command,
+			  uint32_t usb_direction, struct iovec *iov)
+{
+	uint32_t data_offset;
+	int iovcnt = 0;
+
+	iov[iovcnt].iov_base = &packet->hdr;
+	iov[iovcnt].iov_len = sizeof(struct usbip_header);
+	iovcnt++;
+
+	if (command != USBIP_RET_SUBMIT)
+		return iovcnt;
+
+	if (packet->xfer->type == USB_ENDPOINT_XFER_ISOC)
+		return iovcnt + fill_iso_iov(packet, usb_direction, &iov[iovcnt]);
+
+	if (usb_direction == USBIP_DIR_IN) {
+		data_offset = (packet->xfer->endpoint & 0x7f) == 0 ? 8 : 0;
+		iov[iovcnt].iov_base = &packet->xfer->buffer[data_offset];
+		iov[iovcnt].iov_len = packet->xfer->actual_length;
+		iovcnt++;
+	}
+
+	return iovcnt;
+}
+
+/* Appends the header, data and ISO descriptors of a reply to the batch */
+static bool queue_reply(struct tx_batch *batch, struct usb_packet *packet, uint32_t command,
+			uint32_t usb_direction)
+{
+	struct forward_info *f_dev = packet->f_dev;
+	struct iovec *iov;
+
+	/* Not from the data buffers, those may be usbfs memory */
+	if (command == USBIP_RET_SUBMIT && packet->xfer->type == USB_ENDPOINT_XFER_ISOC) {
+		packet->iso_desc = malloc(packet->xfer->num_iso_packets *
+					  sizeof(struct usbip_iso_packet_descriptor));
+		if (!packet->iso_desc) {
+			rh_trace(LVL_ERR, "Can not allocate memory\n");
+			return false;
+		}
+	}
+
+	iov = (struct iovec *)pool_get_scratch(&f_dev->pool, POOL_SCRATCH_TX_IOV,
+					       (batch->iovcnt + reply_iov_count(packet, command)) *
+					       sizeof(struct iovec));
+	if (!iov) {
+		rh_trace(LVL_ERR, "Can not allocate memory\n");
+		return false;
+	}
+
+	batch->iov = iov;
+	for (int i = fill_reply_iov(packet, command, usb_direction, &iov[batch->iovcnt]); i > 0;
+	     i--) {
+		batch->bytes += iov[batch->iovcnt].iov_len;
+		batch->iovcnt++;
+	}
+
+	packet->next = NULL;
+	if (!batch->tail)
+		batch->head = packet;
+	else
+		batch->tail->next = packet;
+	batch->tail = packet;
+
+	return true;
+}
+
+static void drop_replies(struct tx_batch *batch)
+{
+	struct usb_packet *packet;
+
+	while (batch->head) {
+		packet = batch->head;
+		batch->head = packet->next;
+		free_usb_packet(packet);
+	}
+
+	batch->tail = NULL;
+	batch->iovcnt = 0;
+	batch->bytes = 0;
+	batch->urgent = false;
+}
+
+/* Replies to endpoints outside of the coalescing policy of the device are sent at once */
+static bool reply_can_wait(struct forward_info *f_dev, struct usb_packet *packet,
+			   uint32_t command)
+{
+	uint8_t type = packet->xfer->type;
+
+	if (!f_dev->coalesce.enabled || command != USBIP_RET_SUBMIT)
+		return false;
+
+	/* Stream transfers are bulk to the policy */
+	if (type == LIBUSB_TRANSFER_TYPE_BULK_STREAM)
+		type = USB_ENDPOINT_XFER_BULK;
+
+	return f_dev->coalesce.ep_types & (1 << type);
+}
+
+static void deadline_after_us(struct timespec *ts, uint32_t us)
+{
+	clock_gettime(CLOCK_MONOTONIC, ts);
+	ts->tv_sec += us / 1000000;
+	ts->tv_nsec += (us % 1000000) * 1000;
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+/*
+ * Takes the next completed packet and converts it into a reply. Returns false
+ * if there was nothing to send or the packet could not be queued.
+ */
+static bool take_reply(struct forward_info *f_dev, struct tx_batch *batch, bool *flush)
+{
+	uint32_t command, usb_direction;
+	struct usb_packet *packet;
+
+	if (!dequeue_ready_packet(f_dev, &packet))
+		return false;
+
+	if (packet->speculative) {
+		if (packet == f_dev->bot.data || packet == f_dev->bot.csw)
+			bot_complete(f_dev, packet);
+		else
+			prefetch_complete(f_dev, packet);
+		return true;
+	}
+
+	if (packet->unlinked) {
+		/* Successful unlink status is -ECONNRESET */
+		packet->hdr.base.command = USBIP_RET_UNLINK;
+		packet->hdr.u.ret_unlink.status = -ECONNRESET;
+		packet->hdr.base.seqnum = packet->unlinked;
+	}
+
+	command = packet->hdr.base.command;
+	usb_direction = packet->hdr.base.direction;
+	usbip_base_header_to_network_endian(&packet->hdr);
+
+	if (command == USBIP_RET_SUBMIT) {
+		usbip_ret_submit_header_to_network_endian(&packet->hdr);
+	} else if (command == USBIP_RET_UNLINK) {
+		usbip_ret_unlink_header_to_network_endian(&packet->hdr);
+	} else {
+		rh_trace(LVL_DBG, "Unknown command 0x%x\n", command);
+		free_usb_packet(packet);
+		f_dev->terminate = true;
+		return false;
+	}
+
+	if (!reply_can_wait(f_dev, packet, command)) {
+		batch->urgent = true;
+		*flush = true;
+	}
+
+	if (!queue_reply(batch, packet, command, usb_direction)) {
+		free_usb_packet(packet);
+		f_dev->terminate = true;
+		return false;
+	}
+	f_dev->stats.replies++;
+
+	if (batch->bytes >= f_dev->coalesce.max_bytes)
+		*flush = true;
+
+	return true;
+}
+
+static bool deadline_passed(struct timespec *ts)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return now.tv_sec > ts->tv_sec || (now.tv_sec == ts->tv_sec && now.tv_nsec >= ts->tv_nsec);
+}
+
+/*
+ * A batch cut at max_bytes, with replies that may all wait and more of them
+ * completed behind it, lets the stack hold its last partial segment for the
+ * batch that follows.
+ */
+static bool tx_more_follows(struct forward_info *f_dev, struct tx_batch *batch)
+{
+	if (!f_dev->coalesce.enabled || batch->urgent || batch->bytes < f_dev->coalesce.max_bytes)
+		return false;
+
+	return f_dev->ready_head || __atomic_load_n(&f_dev->completed, __ATOMIC_ACQUIRE);
+}
+
+/* Opens the coalescing window, the timer runs the handler once it closes */
+static void tx_arm_deadline(struct forward_info *f_dev)
+{
+	struct itimerspec its = {0};
+
+	deadline_after_us(&f_dev->tx.deadline, f_dev->coalesce.latency_us);
+	its.it_value = f_dev->tx.deadline;
+	if (timerfd_settime(f_dev->timer_src.fd, TFD_TIMER_ABSTIME, &its, NULL))
+		rh_trace(LVL_ERR, "Coalescing timer failed %d\n", errno);
+
+	f_dev->tx.deadline_set = true;
+}
+
+static void tx_disarm_deadline(struct forward_info *f_dev)
+{
+	struct itimerspec its = {0};
+
+	(void) timerfd_settime(f_dev->timer_src.fd, 0, &its, NULL);
+	f_dev->tx.deadline_set = false;
+}
+
+/*
+ * Sends completed packets back. Returns true once replies have gone out,
+ * which also gives their credits back to RX.
+ */
+static bool tx_step(struct server_usb_device *dev)
+{
+	struct forward_info *f_dev = &dev->fwd;
+	struct tx_batch *batch = &f_dev->tx;
+	bool flush = false;
+
+	/* What the socket did not take last time goes out before anything new */
+	if (!batch->sending) {
+		while (!flush && take_reply(f_dev, batch, &flush))
+			;
+
+		if (f_dev->terminate || !batch->iovcnt)
+			return false;
+
+		if (batch->deadline_set && deadline_passed(&batch->deadline))
+			flush = true;
+
+		if (!flush) {
+			if (!batch->deadline_set)
+				tx_arm_deadline(f_dev);
+			return false;
+		}
+
+		if (batch->deadline_set)
+			tx_disarm_deadline(f_dev);
+
+		batch->sending = true;
+		batch->more = tx_more_follows(f_dev, batch);
+		batch->send_iov = batch->iov;
+		batch->send_cnt = batch->iovcnt;
+
+		f_dev->stats.batches++;
+		f_dev->stats.corked += batch->more;
+		f_dev->stats.tx_bytes += batch->bytes;
+
+		if (f_dev->uring.active &&
+		    !uring_send(&f_dev->uring, batch->send_iov, batch->send_cnt, batch->more)) {
+			f_dev->terminate = true;
+			return false;
+		}
+	}
+
+	if (f_dev->uring.active) {
+		/* The send completion brings us back */
+		switch (uring_send_poll(&f_dev->uring)) {
+		case URING_SEND_BUSY:
+			return false;
+		case URING_SEND_FAILED:
+			rh_trace(LVL_DBG, "Reply send failed\n");
+			f_dev->terminate = true;
+			return false;
+		case URING_SEND_DONE:
+			break;
+		}
+	} else {
+		if (!network_send_iov_nb(f_dev->link, &batch->send_iov, &batch->send_cnt,
+					 batch->more)) {
+			rh_trace(LVL_DBG, "Reply send failed\n");
+			f_dev->terminate = true;
+			return false;
+		}
+
+		/* Socket full, EPOLLOUT brings us back */
+		if (batch->send_cnt)
+			return false;
+	}
+
+	batch->sending = false;
+	drop_replies(batch);
+
+	return true;
+}
+
+/* Finds the enumerated device again in the given context */
+static struct libusb_device *find_in_context(libusb_context *ctx, struct libusb_device *dev)
+{
+	struct libusb_device **devs, *found = NULL;
+	ssize_t count;
+
+	count = libusb_get_device_list(ctx, &devs);
+	if (count < 0) {
+		rh_trace(LVL_ERR, "Failed to get device list %s\n", libusb_error_name(count));
+		return NULL;
+	}
+
+	for (ssize_t i = 0; i < count; i++) {
+		if (libusb_get_bus_number(devs[i]) == libusb_get_bus_number(dev) &&
+		    libusb_get_device_address(devs[i]) == libusb_get_device_address(dev)) {
+			found = libusb_ref_device(devs[i]);
+			break;
+		}
+	}
+
+	libusb_free_device_list(devs, 1);
+
+	return found;
+}
+
+/* The export goes to the context running the fewest of them */
+static bool get_shard(struct server_usb_device *dev)
+{
+	struct forward_info *f_dev = &dev->fwd;
+	int shard = 0;
+
+	pthread_mutex_lock(&shard_lock);
+	for (int i = 1; i < usb_shard_count; i++) {
+		if (shard_exports[i] < shard_exports[shard])
+			shard = i;
+	}
+	shard_exports[shard]++;
+	pthread_mutex_unlock(&shard_lock);
+
+	f_dev->shard = shard;
+
+	/* The first context is the one the devices were enumerated from */
+	if (!shard)
+		f_dev->shard_dev = libusb_ref_device(f_dev->libusb_dev);
+	else
+		f_dev->shard_dev = find_in_context(usb_shards[shard], f_dev->libusb_dev);
+
+	if (!f_dev->shard_dev) {
+		rh_trace(LVL_ERR, "Device not found in libusb context %d\n", shard);
+		pthread_mutex_lock(&shard_lock);
+		shard_exports[shard]--;
+		pthread_mutex_unlock(&shard_lock);
+		return false;
+	}
+
+	rh_trace(LVL_DBG, "Export runs on libusb context %d\n", shard);
+
+	return true;
+}
+
+static void put_shard(struct server_usb_device *dev)
+{
+	libusb_unref_device(dev->fwd.shard_dev);
+	dev->fwd.shard_dev = NULL;
+
+	pthread_mutex_lock(&shard_lock);
+	shard_exports[dev->fwd.shard]--;
+	pthread_mutex_unlock(&shard_lock);
+}
+
+static void inform_exported(struct usbip_usb_device dev)
+{
+	struct rh_event event = {0};
+
+	event.type = EVENT_DEVICE_EXPORTED;
+	event.data = &dev;
+	event.size = sizeof(dev);
+	(void) event_enqueue(&event);
+}
+
+static void inform_unexported(struct usbip_usb_device dev)
+{
+	struct rh_event event = {0};
+
+	event.type = EVENT_DEVICE_UNEXPORTED;
+	event.data = &dev;
+	event.size = sizeof(dev);
+	(void) event_enqueue(&event);
+}
+
+static uint64_t monotonic_seconds(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec;
+}
+
+static bool link_peer(struct est_conn *link, struct sockaddr_storage *addr)
+{
+	socklen_t len = sizeof(*addr);
+
+	memset(addr, 0, sizeof(*addr));
+
+	return !getpeername(network_link_fd(link), (struct sockaddr *)addr, &len);
+}
+
+/* Same client host, the port differs between the connections */
+static bool same_host(struct sockaddr_storage *a, struct sockaddr_storage *b)
+{
+	if (a->ss_family != b->ss_family)
+		return false;
+
+	if (a->ss_family == AF_INET)
+		return ((struct sockaddr_in *)a)->sin_addr.s_addr ==
+		       ((struct sockaddr_in *)b)->sin_addr.s_addr;
+
+	if (a->ss_family == AF_INET6)
+		return !memcmp(&((struct sockaddr_in6 *)a)->sin6_addr,
+			       &((struct sockaddr_in6 *)b)->sin6_addr, sizeof(struct in6_addr));
+
+	return false;
+}
+
+/* A busid entry wins over a VID:PID one, without either the default applies */
+static uint32_t warm_seconds(struct server_usb_device *dev)
+{
+	struct warm_info *warm = &fwd_conf.warm;
+	struct warm_device *match = NULL;
+
+	for (uint32_t i = 0; i < warm->device_count; i++) {
+		if (warm->devices[i].busid[0]) {
+			if (!strcmp(warm->devices[i].busid, dev->info.udev.busid))
+				return warm->devices[i].seconds;
+		} else if (!match && warm->devices[i].vid == dev->info.udev.idVendor &&
+			   warm->devices[i].pid == dev->info.udev.idProduct) {
+			match = &warm->devices[i];
+		}
+	}
+
+	return match ? match->seconds : warm->seconds;
+}
+
+/*
+ * Leaves the device opened and claimed after the export for a while, a
+ * client reconnecting meanwhile skips the driver unbind and the resets.
+ */
+static bool keep_warm(struct server_usb_device *dev)
+{
+	struct forward_info *f_dev = &dev->fwd;
+	uint32_t seconds = warm_seconds(dev);
+
+	if (!seconds || !link_peer(f_dev->link, &f_dev->warm_peer))
+		return false;
+
+	f_dev->warm = true;
+	f_dev->warm_until = monotonic_seconds() + seconds;
+	rh_trace(LVL_DBG, "Device kept warm for %u s\n", seconds);
+
+	return true;
+}
+
+static void release_warm(struct server_usb_device *dev)
+{
+	dev->fwd.warm = false;
+	release_device(dev);
+	libusb_close(dev->fwd.handle);
+	put_shard(dev);
+}
+
+/*
+ * Runs once the export has to go. Transfers still at the device are cancelled
+ * first, the rest is released when the last of them has completed.
+ */
+static void forward_teardown(struct server_usb_device *dev)
+{
+	struct forward_info *f_dev = &dev->fwd;
+	struct rh_event event = {0};
+	struct usb_packet *packet;
+	struct pool_stats stats;
+	uint32_t inflight;
+	int ret;
+
+	if (!f_dev->cancelled) {
+		rh_trace(LVL_DBG, "Fwd terminate\n");
+		if (f_dev->uring.active)
+			uring_link_stop(&f_dev->uring);
+		else
+			reactor_remove(&f_dev->link_src);
+
+		/* A command still being received never reached the device */
+		if (f_dev->rx_packet) {
+			free_usb_packet(f_dev->rx_packet);
+			f_dev->rx_packet = NULL;
+		}
+		/* The ring may still be sending from the replies */
+		if (!f_dev->uring.active)
+			drop_replies(&f_dev->tx);
+
+		for (uint32_t i = 0; i <= f_dev->inflight_mask; i++) {
+			for (packet = f_dev->inflight[i]; packet; packet = packet->hnext) {
+				if (__atomic_load_n(&packet->ready, __ATOMIC_RELAXED) ||
+				    !packet->submitted)
+					continue;
+				ret = libusb_cancel_transfer(packet->xfer);
+				if (ret && ret != LIBUSB_ERROR_NOT_FOUND)
+					rh_trace(LVL_ERR, "Cancel transfer failed with %d\n", ret);
+			}
+		}
+		prefetch_cancel(f_dev);
+		bot_cancel(f_dev->bot.data);
+		bot_cancel(f_dev->bot.csw);
+		__atomic_store_n(&f_dev->cancelled, true, __ATOMIC_SEQ_CST);
+	}
+
+	inflight = __atomic_load_n(&f_dev->packets_inflight, __ATOMIC_SEQ_CST);
+
+	/* The last completion runs the handler again */
+	if (inflight) {
+		rh_trace(LVL_DBG, "Waiting for %u completions\n", inflight);
+		return;
+	}
+
+	if (f_dev->uring.active) {
+		if (!uring_link_idle(&f_dev->uring))
+			return;
+		uring_link_release(&f_dev->uring);
+		drop_replies(&f_dev->tx);
+	}
+
+	reactor_remove(&f_dev->wake_src);
+	reactor_remove(&f_dev->timer_src);
+
+	/* The reads ahead belong to their ring */
+	while (dequeue_ready_packet(f_dev, &packet)) {
+		if (!packet->speculative)
+			free_usb_packet(packet);
+	}
+	prefetch_free(f_dev);
+	bot_free(f_dev);
+
+	/* Backlogged packets never reached the device */
+	for (uint32_t i = 0; i <= f_dev->inflight_mask; i++) {
+		while (f_dev->inflight[i]) {
+			packet = f_dev->inflight[i];
+			f_dev->inflight[i] = packet->hnext;
+			free_usb_packet(packet);
+		}
+	}
+	f_dev->packets_backlogged = 0;
+
+	pool_get_stats(&f_dev->pool, &stats);
+	rh_trace(LVL_DBG, "Pool hits %llu misses %llu, peak %llu bytes\n",
+			  (unsigned long long)stats.hits, (unsigned long long)stats.misses,
+			  (unsigned long long)stats.peak_bytes);
+	rh_trace(LVL_DBG, "Sent %llu replies in %llu batches (%llu corked), %llu bytes\n",
+			  (unsigned long long)f_dev->stats.replies,
+			  (unsigned long long)f_dev->stats.batches,
+			  (unsigned long long)f_dev->stats.corked,
+			  (unsigned long long)f_dev->stats.tx_bytes);
+	rh_trace(LVL_DBG, "Received %llu bytes in %llu reads\n",
+			  (unsigned long long)f_dev->stats.rx_bytes,
+			  (unsigned long long)f_dev->stats.rx_reads);
+	pool_destroy(&f_dev->pool);
+	f_dev->rx_buf = NULL;
+	desc_cache_clear(f_dev);
+	free_streams(f_dev);
+
+	if (!keep_warm(dev)) {
+		release_device(dev);
+		libusb_close(f_dev->handle);
+		put_shard(dev);
+	}
+
+	free(f_dev->inflight);
+	f_dev->inflight = NULL;
+
+	network_close_link(f_dev->link);
+	free(f_dev->link);
+	f_dev->link = NULL;
+
+	inform_unexported(dev->info.udev);
+
+	pthread_mutex_lock(&f_dev->buffer_lock);
+	f_dev->stopped = true;
+	pthread_cond_broadcast(&f_dev->buffer_cond);
+	pthread_mutex_unlock(&f_dev->buffer_lock);
+
+	/* The USB task reaps the export now instead of on its next tick */
+	event.type = EVENT_FORWARD_STOPPED;
+	(void) event_enqueue(&event);
+
+	rh_trace(LVL_TRC, "Forwarding stopped\n");
+}
+
+/* Returns false when the device still has work after its rounds on this worker */
+static bool forward_run(struct server_usb_device *dev)
+{
+	bool progress = true;
+
+	if (dev->fwd.stopped)
+		return true;
+
+	/* Replies first, they give RX its credits back */
+	for (int round = 0; progress && !dev->fwd.terminate; round++) {
+		if (round == FORWARD_RUN_ROUNDS)
+			return false;
+
+		progress = tx_step(dev);
+		progress |= rx_step(dev);
+	}
+
+	if (dev->fwd.terminate)
+		forward_teardown(dev);
+
+	return true;
+}
+
+/*
+ * The sources of a device fire on any worker. Whoever raises the pending
+ * count from zero runs the handler until the count drops back, so that the
+ * device is only handled on one worker at a time and no wakeup is lost.
+ * A busy device gives its worker up with the count held, and the wakeup it
+ * leaves behind resumes it on whichever worker takes it.
+ */
+static void forward_kick(struct server_usb_device *dev)
+{
+	uint32_t work;
+
+	if (__atomic_fetch_add(&dev->fwd.work, 1, __ATOMIC_ACQ_REL) &&
+	    !__atomic_exchange_n(&dev->fwd.yielded, false, __ATOMIC_ACQ_REL))
+		return;
+
+	do {
+		work = __atomic_load_n(&dev->fwd.work, __ATOMIC_ACQUIRE);
+		if (!forward_run(dev)) {
+			/* Give the other devices a turn on this worker */
+			__atomic_store_n(&dev->fwd.yielded, true, __ATOMIC_RELEASE);
+			forward_wake(&dev->fwd);
+			return;
+		}
+	} while (__atomic_sub_fetch(&dev->fwd.work, work, __ATOMIC_ACQ_REL));
+}
+
+static void uring_notify(void *ctx)
+{
+	forward_kick((struct server_usb_device *)ctx);
+}
+
+static void link_handler(struct reactor_source *src, uint32_t events)
+{
+	(void) events;
+	forward_kick((struct server_usb_device *)src->data);
+}
+
+/* eventfd and timerfd, only the wakeup matters and not the count */
+static void wakeup_handler(struct reactor_source *src, uint32_t events)
+{
+	uint64_t count;
+
+	(void) events;
+
+	if (read(src->fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		rh_trace(LVL_DBG, "Wakeup read failed %d\n", errno);
+
+	forward_kick((struct server_usb_device *)src->data);
+}
+
+static void init_source(struct reactor_source *src, int fd, uint32_t events,
+			void (*handler)(struct reactor_source *src, uint32_t events),
+			struct server_usb_device *dev)
+{
+	src->fd = fd;
+	src->events = events;
+	src->handler = handler;
+	src->data = dev;
+	src->next = NULL;
+}
+
+/* Sized from the URB limit so deep queues do not end up in long chains */
+static uint32_t inflight_table_size(struct forward_info *f_dev)
+{
+	uint32_t size = INFLIGHT_TABLE_MIN;
+
+	while (size < INFLIGHT_TABLE_MAX && size < 2 * (uint64_t)f_dev->budget.urb_limit)
+		size <<= 1;
+
+	return size;
+}
+
+static bool forward_setup(struct server_usb_device *dev)
+{
+	struct forward_info *f_dev = &dev->fwd;
+	uint32_t table_size;
+	int wake_fd, timer_fd;
+	bool use_uring;
+
+	init_flow_budget(dev);
+	table_size = inflight_table_size(f_dev);
+	f_dev->inflight_mask = table_size - 1;
+	f_dev->inflight = calloc(table_size, sizeof(struct usb_packet *));
+	if (!f_dev->inflight || !pool_init(&f_dev->pool, fwd_conf.pool_hugepages, f_dev->handle)) {
+		rh_trace(LVL_ERR, "Can not allocate memory\n");
+		free(f_dev->inflight);
+		f_dev->inflight = NULL;
+		return false;
+	}
+
+	init_ep_queues(dev);
+	init_tx_coalesce(dev);
+	desc_cache_capture(f_dev);
+	memset(f_dev->prefetch, 0, sizeof(f_dev->prefetch));
+	f_dev->streams = 0;
+	f_dev->stream_ep_count = 0;
+	bot_setup(dev);
+
+	f_dev->rx_buf = pool_get_scratch(&f_dev->pool, POOL_SCRATCH_RX_BUF, RX_BUFFER_SIZE);
+	if (!f_dev->rx_buf) {
+		rh_trace(LVL_ERR, "Can not allocate memory\n");
+		goto err_pool;
+	}
+
+	f_dev->rx_head = 0;
+	f_dev->rx_tail = 0;
+	f_dev->rx_got = 0;
+	f_dev->rx_state = RX_HEADER;
+	f_dev->rx_packet = NULL;
+	memset(&f_dev->tx, 0, sizeof(f_dev->tx));
+	memset(&f_dev->stats, 0, sizeof(f_dev->stats));
+
+	f_dev->ready_head = NULL;
+	f_dev->ready_tail = NULL;
+	f_dev->completed = NULL;
+	f_dev->packets_inflight = 0;
+	f_dev->packets_backlogged = 0;
+
+	/* The ring would see EAGAIN instead of waiting on a non-blocking socket */
+	use_uring = fwd_conf.io_uring && !f_dev->link->encrypted;
+	f_dev->uring.active = false;
+
+	wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+	if (wake_fd < 0 || timer_fd < 0 ||
+	    (!use_uring && !network_set_nonblocking(f_dev->link))) {
+		rh_trace(LVL_ERR, "Forwarding descriptors failed %d\n", errno);
+		goto err_fd;
+	}
+
+	pthread_mutex_init(&f_dev->buffer_lock, NULL);
+	pthread_cond_init(&f_dev->buffer_cond, NULL);
+
+	f_dev->terminate = false;
+	f_dev->cancelled = false;
+	f_dev->stopped = false;
+	f_dev->work = 0;
+	f_dev->yielded = false;
+
+	init_source(&f_dev->wake_src, wake_fd, EPOLLIN | EPOLLET, wakeup_handler, dev);
+	init_source(&f_dev->timer_src, timer_fd, EPOLLIN | EPOLLET, wakeup_handler, dev);
+	init_source(&f_dev->link_src, network_link_fd(f_dev->link),
+		    EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, link_handler, dev);
+
+	inform_exported(dev->info.udev);
+
+	/* Nothing fires the wakeups before the link is in, so the link goes last */
+	if (!reactor_add(&f_dev->wake_src))
+		goto err_sync;
+
+	if (!reactor_add(&f_dev->timer_src)) {
+		reactor_remove(&f_dev->wake_src);
+		goto err_sync;
+	}
+
+	if (use_uring && !uring_link_start(&f_dev->uring, network_link_fd(f_dev->link),
+					   &f_dev->buffer_lock, uring_notify, dev)) {
+		rh_trace(LVL_DBG, "io_uring not in use for the link\n");
+		use_uring = false;
+		if (!network_set_nonblocking(f_dev->link))
+			goto err_link;
+	}
+
+	if (!use_uring && !reactor_add(&f_dev->link_src))
+		goto err_link;
+
+	f_dev->forwarding = true;
+
+	return true;
+
+err_link:
+	reactor_remove(&f_dev->wake_src);
+	reactor_remove(&f_dev->timer_src);
+err_sync:
+	inform_unexported(dev->info.udev);
+	pthread_cond_destroy(&f_dev->buffer_cond);
+	pthread_mutex_destroy(&f_dev->buffer_lock);
+err_fd:
+	if (wake_fd >= 0)
+		close(wake_fd);
+	if (timer_fd >= 0)
+		close(timer_fd);
+err_pool:
+	desc_cache_clear(f_dev);
+	pool_destroy(&f_dev->pool);
+	f_dev->rx_buf = NULL;
+	free(f_dev->inflight);
+	f_dev->inflight = NULL;
+	return false;
+}
+
+void forwarding_init(struct server_info info, libusb_context **shards, int shard_count)
+{
+	fwd_conf = info;
+	usb_shards = shards;
+	usb_shard_count = shard_count;
+}
+
+/* The device is still claimed, only another client gets it reset */
+static bool forwarding_start_warm(struct server_usb_device *dev)
+{
+	struct forward_info *f_dev = &dev->fwd;
+	struct sockaddr_storage peer;
+
+	f_dev->warm = false;
+
+	if (!link_peer(f_dev->link, &peer) || !same_host(&peer, &f_dev->warm_peer)) {
+		rh_trace(LVL_DBG, "Warm device taken by another client\n");
+		libusb_reset_device(f_dev->handle);
+	}
+
+	if (!forward_setup(dev)) {
+		rh_trace(LVL_ERR, "Forwarding setup failed\n");
+		release_warm(dev);
+		return false;
+	}
+
+	return true;
+}
+
+bool forwarding_start(struct server_usb_device *dev)
+{
+	int ret;
+	bool ok;
+
+	if (dev->fwd.warm)
+		return forwarding_start_warm(dev);
+
+	if (dev->info.udev.bNumConfigurations != 1) {
+		rh_trace(LVL_ERR, "Only single config devices supported!\n");
+		return false;
+	}
+
+	if (!get_shard(dev))
+		return false;
+
+	ret = libusb_open(dev->fwd.shard_dev, &dev->fwd.handle);
+	if (ret < 0) {
 		rh_trace(LVL_ERR, "Failed to open device %d, %s - %s\n", ret,
 				  libusb_error_name(ret), libusb_strerror(ret));
+		put_shard(dev);
 		return false;
 	}
 
 	ok = claim_device(dev);
 	if (!ok) {
 		rh_trace(LVL_ERR, "Failed to claim device\n");
+		libusb_close(dev->fwd.handle);
+		put_shard(dev);
 		return false;
 	}
 
 	libusb_reset_device(dev->fwd.handle);
 
-	if (pthread_create(&dev->fwd.forwarding_thread, NULL, monitor, dev)) {
-		rh_trace(LVL_ERR, "Monitoring thread creation failed\n");
-		dev->fwd.forwarding_thread = 0;
+	ok = forward_setup(dev);
+	if (!ok) {
+		rh_trace(LVL_ERR, "Forwarding setup failed\n");
 		release_device(dev);
+		libusb_close(dev->fwd.handle);
+		put_shard(dev);
 		return false;
 	}
 
 	return true;
 }
+
+/* Asks the export to stop, forwarding_wait reaps it */
+void forwarding_stop(struct server_usb_device *dev)
+{
+	if (!dev->fwd.forwarding)
+		return;
+
+	pthread_mutex_lock(&dev->fwd.buffer_lock);
+	dev->fwd.terminate = true;
+	if (!dev->fwd.stopped)
+		forward_wake(&dev->fwd);
+	pthread_mutex_unlock(&dev->fwd.buffer_lock);
+}
+
+/* Gives a warm device back once its grace period is over, or right away */
+void forwarding_cool(struct server_usb_device *dev, bool now)
+{
+	if (dev->fwd.forwarding || !dev->fwd.warm)
+		return;
+
+	if (!now && monotonic_seconds() < dev->fwd.warm_until)
+		return;
+
+	rh_trace(LVL_DBG, "Releasing warm device %s\n", dev->info.udev.busid);
+	release_warm(dev);
+}
+
+/* Waits for the teardown of a terminated export, not for reactor handlers */
+void forwarding_wait(struct server_usb_device *dev)
+{
+	if (!dev->fwd.forwarding)
+		return;
+
+	pthread_mutex_lock(&dev->fwd.buffer_lock);
+	while (!dev->fwd.stopped)
+		pthread_cond_wait(&dev->fwd.buffer_cond, &dev->fwd.buffer_lock);
+	pthread_mutex_unlock(&dev->fwd.buffer_lock);
+
+	/* Events taken before the sources were removed may still be handled */
+	reactor_quiesce();
+
+	close(dev->fwd.wake_src.fd);
+	close(dev->fwd.timer_src.fd);
+	pthread_cond_destroy(&dev->fwd.buffer_cond);
+	pthread_mutex_destroy(&dev->fwd.buffer_lock);
+
+	dev->fwd.forwarding = false;
+	dev->fwd.terminate = false;
+}
@@ -0,0 +1,354 @@
+/*
+ * Copyright (C) 2021 Jani Laitinen
+ *
+ * This file is part of RemoteHub.
+ *
+ * RemoteHub is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * RemoteHub is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with RemoteHub.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+
+#include <sys/mman.h>
+
+#include "pool.h"
+#include "logging.h"
+
+static void account_alloc(struct packet_pool *pool, uint64_t bytes)
+{
+	pool->stats.misses++;
+	pool->stats.current_bytes += bytes;
+	if (pool->stats.current_bytes > pool->stats.peak_bytes)
+		pool->stats.peak_bytes = pool->stats.current_bytes;
+}
+
+static void account_free(struct packet_pool *pool, uint64_t bytes)
+{
+	pool->stats.current_bytes -= bytes;
+}
+
+static int buf_class(uint32_t size)
+{
+	for (int i = 0; i < POOL_BUF_CLASSES; i++) {
+		if (size <= 1UL << (POOL_BUF_MIN_SHIFT + i * POOL_BUF_CLASS_SHIFT))
+			return i;
+	}
+
+	return -1;
+}
+
+static uint32_t buf_class_size(int class)
+{
+	return 1UL << (POOL_BUF_MIN_SHIFT + class * POOL_BUF_CLASS_SHIFT);
+}
+
+static int xfer_class(int num_iso)
+{
+	if (num_iso <= 0)
+		return 0;
+
+	for (int i = 1; i < POOL_XFER_CLASSES; i++) {
+		if (num_iso <= 1 << (i - 1))
+			return i;
+	}
+
+	return -1;
+}
+
+static size_t xfer_size(int num_iso)
+{
+	return sizeof(struct libusb_transfer) +
+	       num_iso * sizeof(struct libusb_iso_packet_descriptor);
+}
+
+static uint8_t *map_chunk(struct packet_pool *pool, struct pool_chunk *chunk, size_t size)
+{
+	void *mem;
+
+#ifdef POOL_HAVE_DEV_MEM
+	/* Transfers from usbfs mapped memory skip the kernel bounce copy */
+	if (pool->dev_mem) {
+		mem = libusb_dev_mem_alloc(pool->handle, size);
+		if (mem) {
+			chunk->dev_mem = true;
+			return mem;
+		}
+
+		rh_trace(LVL_DBG, "No usbfs memory for %zu bytes, using heap\n", size);
+	}
+#else
+	(void) chunk;
+#endif
+
+	if (pool->hugepages) {
+		mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (mem != MAP_FAILED)
+			return mem;
+
+		rh_trace(LVL_WARN, "Hugepages not available, using normal pages\n");
+		pool->hugepages = false;
+	}
+
+	mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED)
+		return NULL;
+
+	return mem;
+}
+
+/* Called with pool lock held */
+static bool add_chunk(struct packet_pool *pool, int class)
+{
+	struct pool_chunk *chunk;
+	uint32_t bufsize = buf_class_size(class);
+	size_t size = (size_t)bufsize * POOL_BUFS_PER_CHUNK;
+
+	if (pool->hugepages)
+		size = (size + POOL_HUGEPAGE_SIZE - 1) & ~((size_t)POOL_HUGEPAGE_SIZE - 1);
+
+	chunk = calloc(1, sizeof(struct pool_chunk));
+	if (!chunk)
+		return false;
+
+	chunk->mem = map_chunk(pool, chunk, size);
+	if (!chunk->mem) {
+		rh_trace(LVL_ERR, "Can not map %zu bytes\n", size);
+		free(chunk);
+		return false;
+	}
+
+	chunk->size = size;
+	chunk->next = pool->chunks;
+	pool->chunks = chunk;
+	account_alloc(pool, size + sizeof(struct pool_chunk));
+
+	for (size_t offset = 0; offset + bufsize <= size; offset += bufsize) {
+		*(uint8_t **)&chunk->mem[offset] = pool->bufs[class];
+		pool->bufs[class] = &chunk->mem[offset];
+	}
+
+	return true;
+}
+
+struct usb_packet *pool_get_packet(struct packet_pool *pool)
+{
+	struct usb_packet *packet;
+
+	pthread_mutex_lock(&pool->lock);
+
+	packet = pool->packets;
+	if (packet) {
+		pool->packets = packet->next;
+		pool->stats.hits++;
+		pthread_mutex_unlock(&pool->lock);
+		memset(packet, 0, sizeof(struct usb_packet));
+		return packet;
+	}
+
+	packet = calloc(1, sizeof(struct usb_packet));
+	if (packet)
+		account_alloc(pool, sizeof(struct usb_packet));
+
+	pthread_mutex_unlock(&pool->lock);
+	return packet;
+}
+
+void pool_put_packet(struct packet_pool *pool, struct usb_packet *packet)
+{
+	pthread_mutex_lock(&pool->lock);
+	packet->next = pool->packets;
+	pool->packets = packet;
+	pthread_mutex_unlock(&pool->lock);
+}
+
+struct libusb_transfer *pool_get_transfer(struct packet_pool *pool, int num_iso)
+{
+	struct libusb_transfer *xfer;
+	int class = xfer_class(num_iso);
+	int capacity = num_iso;
+
+	pthread_mutex_lock(&pool->lock);
+
+	if (class >= 0 && pool->xfers[class]) {
+		xfer = pool->xfers[class];
+		pool->xfers[class] = xfer->user_data;
+		pool->stats.hits++;
+		pthread_mutex_unlock(&pool->lock);
+		return xfer;
+	}
+
+	if (class > 0)
+		capacity = 1 << (class - 1);
+
+	xfer = libusb_alloc_transfer(capacity);
+	if (xfer)
+		account_alloc(pool, xfer_size(capacity));
+
+	pthread_mutex_unlock(&pool->lock);
+	return xfer;
+}
+
+void pool_put_transfer(struct packet_pool *pool, struct libusb_transfer *xfer)
+{
+	int class = xfer_class(xfer->num_iso_packets);
+
+	pthread_mutex_lock(&pool->lock);
+
+	if (class < 0) {
+		account_free(pool, xfer_size(xfer->num_iso_packets));
+		pthread_mutex_unlock(&pool->lock);
+		libusb_free_transfer(xfer);
+		return;
+	}
+
+	xfer->user_data = pool->xfers[class];
+	pool->xfers[class] = xfer;
+
+	pthread_mutex_unlock(&pool->lock);
+}
+
+uint8_t *pool_get_buffer(struct packet_pool *pool, uint32_t size)
+{
+	uint8_t *buf;
+	int class = buf_class(size);
+
+	pthread_mutex_lock(&pool->lock);
+
+	if (class < 0) {
+		buf = malloc(size);
+		if (buf)
+			account_alloc(pool, size);
+		pthread_mutex_unlock(&pool->lock);
+		return buf;
+	}
+
+	if (pool->bufs[class]) {
+		pool->stats.hits++;
+	} else if (!add_chunk(pool, class)) {
+		pthread_mutex_unlock(&pool->lock);
+		return NULL;
+	}
+
+	buf = pool->bufs[class];
+	pool->bufs[class] = *(uint8_t **)buf;
+
+	pthread_mutex_unlock(&pool->lock);
+	return buf;
+}
+
+void pool_put_buffer(struct packet_pool *pool, uint8_t *buf, uint32_t size)
+{
+	int class = buf_class(size);
+
+	pthread_mutex_lock(&pool->lock);
+
+	if (class < 0) {
+		account_free(pool, size);
+		pthread_mutex_unlock(&pool->lock);
+		free(buf);
+		return;
+	}
+
+	*(uint8_t **)buf = pool->bufs[class];
+	pool->bufs[class] = buf;
+
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/* Scratch areas are only grown, and keep their contents when they are grown */
+uint8_t *pool_get_scratch(struct packet_pool *pool, enum pool_scratch id, uint32_t size)
+{
+	uint8_t *scratch;
+
+	if (size <= pool->scratch_size[id])
+		return pool->scratch[id];
+
+	scratch = realloc(pool->scratch[id], size);
+	if (!scratch)
+		return NULL;
+
+	pthread_mutex_lock(&pool->lock);
+	account_alloc(pool, size - pool->scratch_size[id]);
+	pthread_mutex_unlock(&pool->lock);
+
+	pool->scratch[id] = scratch;
+	pool->scratch_size[id] = size;
+
+	return scratch;
+}
+
+void pool_get_stats(struct packet_pool *pool, struct pool_stats *stats)
+{
+	pthread_mutex_lock(&pool->lock);
+	*stats = pool->stats;
+	pthread_mutex_unlock(&pool->lock);
+}
+
+bool pool_init(struct packet_pool *pool, bool hugepages, libusb_device_handle *handle)
+{
+	memset(pool, 0, sizeof(struct packet_pool));
+	pool->hugepages = hugepages;
+	pool->handle = handle;
+#ifdef POOL_HAVE_DEV_MEM
+	pool->dev_mem = handle != NULL;
+#endif
+
+	if (pthread_mutex_init(&pool->lock, NULL))
+		return false;
+
+	return true;
+}
+
+/*
+ * All packets, transfers and buffers must have been returned and the device
+ * handle must still be open.
+ */
+void pool_destroy(struct packet_pool *pool)
+{
+	struct usb_packet *packet;
+	struct libusb_transfer *xfer;
+	struct pool_chunk *chunk;
+
+	while (pool->packets) {
+		packet = pool->packets;
+		pool->packets = packet->next;
+		free(packet);
+	}
+
+	for (int i = 0; i < POOL_XFER_CLASSES; i++) {
+		while (pool->xfers[i]) {
+			xfer = pool->xfers[i];
+			pool->xfers[i] = xfer->user_data;
+			libusb_free_transfer(xfer);
+		}
+	}
+
+	while (pool->chunks) {
+		chunk = pool->chunks;
+		pool->chunks = chunk->next;
+#ifdef POOL_HAVE_DEV_MEM
+		if (chunk->dev_mem)
+			libusb_dev_mem_free(pool->handle, chunk->mem, chunk->size);
+		else
+#endif
+			munmap(chunk->mem, chunk->size);
+		free(chunk);
+	}
+
+	for (int i = 0; i < POOL_SCRATCH_COUNT; i++)
+		free(pool->scratch[i]);
+	pthread_mutex_destroy(&pool->lock);
+	memset(pool, 0, sizeof(struct packet_pool));
+}
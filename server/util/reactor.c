@@ -0,0 +1,461 @@
+/*
+ * Copyright (C) 2021 Jani Laitinen
+ *
+ * This file is part of RemoteHub.
+ *
+ * RemoteHub is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * RemoteHub is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with RemoteHub.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sched.h>
+
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <libusb-1.0/libusb.h>
+
+#include "logging.h"
+#include "reactor.h"
+
+/*
+ * A fixed set of worker threads waits on one epoll instance. Forwarded devices
+ * register their sockets and wakeup descriptors, libusb registers its pollfds,
+ * so the worker count follows the cores instead of the exported devices.
+ * libusb handles the events of a context on one thread at a time, so the
+ * exports are spread over several contexts for their completions to run
+ * on several workers.
+ */
+
+struct reactor_worker {
+	pthread_t			thread;
+	/* Odd from the return of epoll_wait until its handlers are done */
+	uint64_t			seq;
+};
+
+static bool reactor_running;
+static int epoll_fd = -1;
+static int worker_count;
+static struct reactor_worker workers[REACTOR_MAX_WORKERS];
+static __thread struct reactor_worker *current_worker;
+/* Runs after each batch of handlers, lets a backend submit their work at once */
+static void (*batch_flush)(void);
+
+/*
+ * libusb handles the events of a context on one thread at a time. The first
+ * worker to get an event of a context handles it, events that come in
+ * meanwhile only raise work and are handled by the same worker in another
+ * pass. Fired sources stay disarmed until the pass that covers them is done,
+ * so the others do not spin on a pollfd that is still readable.
+ */
+struct usb_ctx_info {
+	libusb_context			*ctx;
+	/* Timeouts without a pollfd, run by the tick of worker 0 */
+	bool				tick;
+	uint32_t			work;
+};
+
+struct usb_source {
+	struct reactor_source		src;
+	/* Disarmed until the context has been handled, under usb_source_lock */
+	bool				fired;
+};
+
+static struct reactor_source stop_src = { .fd = -1 };
+/* Readable while a quiesce wakes the idle workers */
+static struct reactor_source quiesce_src = { .fd = -1 };
+static pthread_mutex_t quiesce_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct usb_ctx_info usb_ctx[REACTOR_MAX_USB_CONTEXTS];
+static int usb_ctx_count;
+static bool usb_tick;
+static pthread_mutex_t usb_source_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Sources dropped by libusb keep fd -1 and are reused, a handler may still hold one */
+static struct usb_source *usb_sources;
+
+static bool reactor_ctl(int op, struct reactor_source *src)
+{
+	struct epoll_event ev = {0};
+
+	ev.events = src->events;
+	ev.data.ptr = src;
+
+	if (epoll_ctl(epoll_fd, op, src->fd, &ev)) {
+		rh_trace(LVL_ERR, "epoll_ctl %d for fd %d failed %d\n", op, src->fd, errno);
+		return false;
+	}
+
+	return true;
+}
+
+bool reactor_add(struct reactor_source *src)
+{
+	return reactor_ctl(EPOLL_CTL_ADD, src);
+}
+
+/* Enables an EPOLLONESHOT source again once its handler is done */
+bool reactor_rearm(struct reactor_source *src)
+{
+	return reactor_ctl(EPOLL_CTL_MOD, src);
+}
+
+/*
+ * Events already taken by other workers may still be handled after this,
+ * use reactor_quiesce before releasing the memory of the source.
+ */
+void reactor_remove(struct reactor_source *src)
+{
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, src->fd, NULL))
+		rh_trace(LVL_DBG, "epoll_ctl del for fd %d failed %d\n", src->fd, errno);
+}
+
+/*
+ * Waits until every worker has finished a whole round of epoll_wait and
+ * handlers that began after the call. A worker that seems idle may already
+ * hold events of a removed source from an epoll_wait that has returned, so
+ * idle workers are woken to go round too. The wakeup is cleared as soon as
+ * every worker has moved on from where it was, the rest of the wait does
+ * not keep them spinning. Not for handlers.
+ */
+void reactor_quiesce(void)
+{
+	uint64_t seq[REACTOR_MAX_WORKERS], start[REACTOR_MAX_WORKERS], one = 1, count;
+
+	if (current_worker) {
+		rh_trace(LVL_ERR, "Quiesce called from a reactor worker\n");
+		return;
+	}
+
+	if (!worker_count)
+		return;
+
+	pthread_mutex_lock(&quiesce_lock);
+
+	for (int i = 0; i < worker_count; i++) {
+		/* The end of the round in progress, or of the next one */
+		start[i] = __atomic_load_n(&workers[i].seq, __ATOMIC_ACQUIRE);
+		seq[i] = start[i] + ((start[i] & 1) ? 1 : 2);
+	}
+
+	if (write(quiesce_src.fd, &one, sizeof(one)) != sizeof(one))
+		rh_trace(LVL_ERR, "Quiesce wakeup failed %d\n", errno);
+
+	/* Each worker has returned from the epoll_wait it was in, or finished its round */
+	for (int i = 0; i < worker_count; i++) {
+		while (__atomic_load_n(&workers[i].seq, __ATOMIC_ACQUIRE) == start[i] &&
+		       __atomic_load_n(&reactor_running, __ATOMIC_ACQUIRE))
+			sched_yield();
+	}
+
+	if (read(quiesce_src.fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		rh_trace(LVL_DBG, "Quiesce read failed %d\n", errno);
+
+	for (int i = 0; i < worker_count; i++) {
+		/* Stopped workers run no more handlers */
+		while ((int64_t)(__atomic_load_n(&workers[i].seq, __ATOMIC_ACQUIRE) - seq[i]) < 0 &&
+		       __atomic_load_n(&reactor_running, __ATOMIC_ACQUIRE))
+			sched_yield();
+	}
+
+	pthread_mutex_unlock(&quiesce_lock);
+}
+
+void reactor_set_flush(void (*flush)(void))
+{
+	__atomic_store_n(&batch_flush, flush, __ATOMIC_RELEASE);
+}
+
+/* Called with usb_source_lock held */
+static void rearm_usb_sources(struct usb_ctx_info *info)
+{
+	struct usb_source *usb_src;
+
+	for (usb_src = usb_sources; usb_src; usb_src = (struct usb_source *)usb_src->src.next) {
+		if (!usb_src->fired || usb_src->src.data != info)
+			continue;
+		usb_src->fired = false;
+		if (usb_src->src.fd >= 0)
+			(void) reactor_rearm(&usb_src->src);
+	}
+}
+
+/* Handles the context unless another worker does, that one then goes round again */
+static void run_usb_context(struct usb_ctx_info *info)
+{
+	struct timeval tv = {0};
+	uint32_t work;
+	int ret;
+
+	if (__atomic_fetch_add(&info->work, 1, __ATOMIC_ACQ_REL))
+		return;
+
+	do {
+		work = __atomic_load_n(&info->work, __ATOMIC_ACQUIRE);
+
+		ret = libusb_handle_events_timeout_completed(info->ctx, &tv, NULL);
+		if (ret)
+			rh_trace(LVL_DBG, "Libusb event handling failed %s\n",
+				 libusb_error_name(ret));
+
+		/* Sources that fire again after this bring in another pass */
+		pthread_mutex_lock(&usb_source_lock);
+		rearm_usb_sources(info);
+		pthread_mutex_unlock(&usb_source_lock);
+	} while (__atomic_sub_fetch(&info->work, work, __ATOMIC_ACQ_REL));
+}
+
+static void usb_source_handler(struct reactor_source *src, uint32_t events)
+{
+	(void) events;
+
+	pthread_mutex_lock(&usb_source_lock);
+	((struct usb_source *)src)->fired = true;
+	pthread_mutex_unlock(&usb_source_lock);
+
+	run_usb_context((struct usb_ctx_info *)src->data);
+}
+
+static void usb_pollfd_added(int fd, short events, void *user_data)
+{
+	struct usb_source *usb_src, *unused = NULL;
+	struct reactor_source *src;
+
+	pthread_mutex_lock(&usb_source_lock);
+
+	for (usb_src = usb_sources; usb_src; usb_src = (struct usb_source *)usb_src->src.next) {
+		if (usb_src->src.fd == fd)
+			goto out;
+		if (usb_src->src.fd < 0 && !unused)
+			unused = usb_src;
+	}
+
+	usb_src = unused;
+	if (!usb_src) {
+		usb_src = calloc(1, sizeof(struct usb_source));
+		if (!usb_src) {
+			rh_trace(LVL_ERR, "Can not allocate memory\n");
+			goto out;
+		}
+		usb_src->src.next = (struct reactor_source *)usb_sources;
+		usb_sources = usb_src;
+	}
+
+	/* poll and epoll share the values of the basic events */
+	usb_src->fired = false;
+	src = &usb_src->src;
+	src->fd = fd;
+	src->events = (uint32_t)events | EPOLLONESHOT;
+	src->handler = usb_source_handler;
+	src->data = user_data;
+	if (!reactor_add(src))
+		src->fd = -1;
+out:
+	pthread_mutex_unlock(&usb_source_lock);
+}
+
+static void usb_pollfd_removed(int fd, void *user_data)
+{
+	struct usb_source *usb_src;
+
+	(void) user_data;
+
+	pthread_mutex_lock(&usb_source_lock);
+	for (usb_src = usb_sources; usb_src; usb_src = (struct usb_source *)usb_src->src.next) {
+		if (usb_src->src.fd != fd)
+			continue;
+		reactor_remove(&usb_src->src);
+		usb_src->src.fd = -1;
+		break;
+	}
+	pthread_mutex_unlock(&usb_source_lock);
+}
+
+static bool watch_libusb(libusb_context *ctx)
+{
+	struct usb_ctx_info *info = &usb_ctx[usb_ctx_count++];
+	const struct libusb_pollfd **pollfds;
+
+	info->ctx = ctx;
+	info->tick = !libusb_pollfds_handle_timeouts(ctx);
+	info->work = 0;
+	usb_tick |= info->tick;
+
+	libusb_set_pollfd_notifiers(ctx, usb_pollfd_added, usb_pollfd_removed, info);
+
+	pollfds = libusb_get_pollfds(ctx);
+	if (!pollfds) {
+		rh_trace(LVL_ERR, "Failed to get libusb pollfds\n");
+		return false;
+	}
+
+	for (int i = 0; pollfds[i]; i++)
+		usb_pollfd_added(pollfds[i]->fd, pollfds[i]->events, info);
+
+	libusb_free_pollfds(pollfds);
+
+	return true;
+}
+
+/* Also for the quiesce, left readable until every worker has woken up */
+static void stop_handler(struct reactor_source *src, uint32_t events)
+{
+	(void) src;
+	(void) events;
+}
+
+static void *reactor_worker(void *arg)
+{
+	struct reactor_worker *worker = (struct reactor_worker *)arg;
+	struct epoll_event events[REACTOR_MAX_EVENTS];
+	struct reactor_source *src;
+	void (*flush)(void);
+	int n, timeout = -1;
+
+	current_worker = worker;
+
+	/* One worker runs the libusb timeouts when those have no pollfd */
+	if (worker == &workers[0] && usb_tick)
+		timeout = REACTOR_TICK_MS;
+
+	while (reactor_running) {
+		n = epoll_wait(epoll_fd, events, REACTOR_MAX_EVENTS, timeout);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			rh_trace(LVL_ERR, "epoll_wait failed %d\n", errno);
+			break;
+		}
+
+		__atomic_add_fetch(&worker->seq, 1, __ATOMIC_ACQ_REL);
+
+		for (int i = 0; i < n; i++) {
+			src = (struct reactor_source *)events[i].data.ptr;
+			src->handler(src, events[i].events);
+		}
+
+		for (int i = 0; !n && timeout >= 0 && i < usb_ctx_count; i++) {
+			if (usb_ctx[i].tick)
+				run_usb_context(&usb_ctx[i]);
+		}
+
+		flush = __atomic_load_n(&batch_flush, __ATOMIC_ACQUIRE);
+		if (flush)
+			flush();
+
+		__atomic_add_fetch(&worker->seq, 1, __ATOMIC_ACQ_REL);
+	}
+
+	rh_trace(LVL_TRC, "Reactor worker exit\n");
+	return NULL;
+}
+
+/* Every libusb context gets its events handled by the workers */
+bool reactor_init(libusb_context **ctx, int ctx_count)
+{
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0) {
+		rh_trace(LVL_ERR, "epoll_create failed %d\n", errno);
+		return false;
+	}
+
+	stop_src.fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	stop_src.events = EPOLLIN;
+	stop_src.handler = stop_handler;
+	if (stop_src.fd < 0 || !reactor_add(&stop_src)) {
+		rh_trace(LVL_ERR, "Reactor stop event failed\n");
+		goto err_exit;
+	}
+
+	quiesce_src.fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	quiesce_src.events = EPOLLIN;
+	quiesce_src.handler = stop_handler;
+	if (quiesce_src.fd < 0 || !reactor_add(&quiesce_src)) {
+		rh_trace(LVL_ERR, "Reactor quiesce event failed\n");
+		goto err_exit;
+	}
+
+	if (ctx_count > REACTOR_MAX_USB_CONTEXTS) {
+		rh_trace(LVL_ERR, "Too many libusb contexts %d\n", ctx_count);
+		goto err_exit;
+	}
+
+	for (int i = 0; i < ctx_count; i++) {
+		if (!watch_libusb(ctx[i]))
+			goto err_exit;
+	}
+
+	worker_count = cores < 1 ? 1 : cores;
+	if (worker_count > REACTOR_MAX_WORKERS)
+		worker_count = REACTOR_MAX_WORKERS;
+
+	reactor_running = true;
+	for (int i = 0; i < worker_count; i++) {
+		if (pthread_create(&workers[i].thread, NULL, reactor_worker, &workers[i])) {
+			rh_trace(LVL_ERR, "Failed to start reactor worker %d\n", i);
+			worker_count = i;
+			goto err_exit;
+		}
+	}
+
+	rh_trace(LVL_DBG, "Reactor running %d workers\n", worker_count);
+
+	return true;
+
+err_exit:
+	reactor_exit();
+	return false;
+}
+
+void reactor_exit(void)
+{
+	uint64_t one = 1;
+	struct usb_source *usb_src;
+
+	reactor_running = false;
+	if (stop_src.fd >= 0 && write(stop_src.fd, &one, sizeof(one)) != sizeof(one))
+		rh_trace(LVL_ERR, "Reactor stop failed %d\n", errno);
+
+	for (int i = 0; i < worker_count; i++)
+		pthread_join(workers[i].thread, NULL);
+	worker_count = 0;
+
+	for (int i = 0; i < usb_ctx_count; i++)
+		libusb_set_pollfd_notifiers(usb_ctx[i].ctx, NULL, NULL, NULL);
+	usb_ctx_count = 0;
+	usb_tick = false;
+
+	while (usb_sources) {
+		usb_src = usb_sources;
+		usb_sources = (struct usb_source *)usb_src->src.next;
+		free(usb_src);
+	}
+
+	if (stop_src.fd >= 0)
+		close(stop_src.fd);
+	stop_src.fd = -1;
+
+	if (quiesce_src.fd >= 0)
+		close(quiesce_src.fd);
+	quiesce_src.fd = -1;
+
+	if (epoll_fd >= 0)
+		close(epoll_fd);
+	epoll_fd = -1;
+
+	rh_trace(LVL_TRC, "Reactor terminated\n");
+}
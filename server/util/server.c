@@ -20,6 +20,7 @@
 #include <signal.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "cJSON.h"
 #include "mbedtls/version.h"
@@ -98,7 +99,7 @@ static int rh_server_init(struct server_info info)
 		goto err_exit;
 	}
 
-	success = usb_task_init();
+	success = usb_task_init(info);
 	if (!success) {
 		rh_trace(LVL_ERR, "USB task init failed\n");
 		ret = RH_FAIL_INIT_USB;
@@ -138,6 +139,203 @@ err_exit:
 	return ret;
 }
 
+static uint8_t parse_ep_types(cJSON *types)
+{
+	cJSON *type;
+	char *name;
+	uint8_t mask = 0;
+
+	cJSON_ArrayForEach(type, types) {
+		name = cJSON_GetStringValue(type);
+		if (!name)
+			continue;
+		if (!strcmp(name, "control"))
+			mask |= 1 << USB_ENDPOINT_XFER_CONTROL;
+		else if (!strcmp(name, "isochronous"))
+			mask |= 1 << USB_ENDPOINT_XFER_ISOC;
+		else if (!strcmp(name, "bulk"))
+			mask |= 1 << USB_ENDPOINT_XFER_BULK;
+		else if (!strcmp(name, "interrupt"))
+			mask |= 1 << USB_ENDPOINT_XFER_INT;
+		else
+			rh_trace(LVL_ERR, "Unknown endpoint type %s\n", name);
+	}
+
+	return mask;
+}
+
+/* Only the keys that are present change the policy */
+static void parse_coalesce_policy(cJSON *policy_obj, struct tx_coalesce_policy *policy)
+{
+	cJSON *item;
+
+	item = cJSON_GetObjectItem(policy_obj, "enabled");
+	if (item && cJSON_IsBool(item))
+		policy->enabled = cJSON_IsTrue(item);
+
+	item = cJSON_GetObjectItem(policy_obj, "latency_us");
+	if (item && cJSON_IsNumber(item))
+		policy->latency_us = (uint32_t)cJSON_GetNumberValue(item);
+
+	item = cJSON_GetObjectItem(policy_obj, "max_bytes");
+	if (item && cJSON_IsNumber(item))
+		policy->max_bytes = (uint32_t)cJSON_GetNumberValue(item);
+
+	item = cJSON_GetObjectItem(policy_obj, "endpoint_types");
+	if (item && cJSON_IsArray(item))
+		policy->ep_types = parse_ep_types(item);
+}
+
+static void parse_tx_coalescing(cJSON *config_json, struct tx_coalesce_info *coalesce)
+{
+	struct tx_coalesce_policy *policy = &coalesce->policy;
+	cJSON *coalesce_obj, *classes, *class_obj, *item;
+	struct tx_coalesce_class *cls;
+
+	policy->enabled = false;
+	policy->latency_us = 200;
+	policy->max_bytes = 64 * 1024;
+	policy->ep_types = (1 << USB_ENDPOINT_XFER_BULK) | (1 << USB_ENDPOINT_XFER_ISOC);
+	coalesce->class_count = 0;
+
+	coalesce_obj = cJSON_GetObjectItem(config_json, "tx_coalescing");
+	if (!coalesce_obj)
+		return;
+
+	parse_coalesce_policy(coalesce_obj, policy);
+	if (policy->enabled)
+		rh_trace(LVL_DBG, "TX coalescing %u us / %u bytes, types 0x%x\n",
+				  policy->latency_us, policy->max_bytes, policy->ep_types);
+
+	/* A class takes the default and changes what it lists */
+	classes = cJSON_GetObjectItem(coalesce_obj, "device_classes");
+	cJSON_ArrayForEach(class_obj, classes) {
+		if (coalesce->class_count >= COALESCE_CLASS_MAX_COUNT) {
+			rh_trace(LVL_ERR, "Too many coalescing classes\n");
+			break;
+		}
+
+		item = cJSON_GetObjectItem(class_obj, "class");
+		if (!item || !cJSON_IsNumber(item))
+			continue;
+
+		cls = &coalesce->classes[coalesce->class_count++];
+		cls->usb_class = (uint8_t)cJSON_GetNumberValue(item);
+		cls->policy = *policy;
+		parse_coalesce_policy(class_obj, &cls->policy);
+		rh_trace(LVL_DBG, "Class 0x%02x TX coalescing %d, %u us / %u bytes\n",
+				  cls->usb_class, cls->policy.enabled, cls->policy.latency_us,
+				  cls->policy.max_bytes);
+	}
+}
+
+static void parse_flow_budget(cJSON *budget_obj, struct flow_budget *budget)
+{
+	cJSON *item;
+
+	if (!budget_obj)
+		return;
+
+	item = cJSON_GetObjectItem(budget_obj, "byte_budget");
+	if (item && cJSON_IsNumber(item))
+		budget->byte_budget = (uint32_t)cJSON_GetNumberValue(item);
+
+	item = cJSON_GetObjectItem(budget_obj, "urb_limit");
+	if (item && cJSON_IsNumber(item))
+		budget->urb_limit = (uint32_t)cJSON_GetNumberValue(item);
+}
+
+static void parse_flow_control(cJSON *config_json, struct flow_control_info *fc)
+{
+	cJSON *fc_obj, *classes, *class_obj, *item;
+	struct flow_class_budget *cls;
+
+	fc->usb2.byte_budget = FLOW_USB2_BYTE_BUDGET;
+	fc->usb2.urb_limit = FLOW_USB2_URB_LIMIT;
+	fc->usb3.byte_budget = FLOW_USB3_BYTE_BUDGET;
+	fc->usb3.urb_limit = FLOW_USB3_URB_LIMIT;
+	fc->class_count = 0;
+
+	fc_obj = cJSON_GetObjectItem(config_json, "flow_control");
+	if (!fc_obj)
+		return;
+
+	parse_flow_budget(cJSON_GetObjectItem(fc_obj, "usb2"), &fc->usb2);
+	parse_flow_budget(cJSON_GetObjectItem(fc_obj, "usb3"), &fc->usb3);
+
+	classes = cJSON_GetObjectItem(fc_obj, "device_classes");
+	cJSON_ArrayForEach(class_obj, classes) {
+		if (fc->class_count >= FLOW_CLASS_MAX_COUNT) {
+			rh_trace(LVL_ERR, "Too many flow control classes\n");
+			break;
+		}
+
+		item = cJSON_GetObjectItem(class_obj, "class");
+		if (!item || !cJSON_IsNumber(item))
+			continue;
+
+		cls = &fc->classes[fc->class_count++];
+		cls->usb_class = (uint8_t)cJSON_GetNumberValue(item);
+		parse_flow_budget(class_obj, &cls->budget);
+		rh_trace(LVL_DBG, "Class 0x%02x flow budget %u bytes / %u URBs\n", cls->usb_class,
+				  cls->budget.byte_budget, cls->budget.urb_limit);
+	}
+}
+
+static void parse_keep_warm(cJSON *config_json, struct warm_info *warm)
+{
+	cJSON *warm_obj, *devices, *dev_obj, *item;
+	struct warm_device *dev;
+	unsigned int vid, pid;
+
+	warm->seconds = 0;
+	warm->device_count = 0;
+
+	warm_obj = cJSON_GetObjectItem(config_json, "warm_seconds");
+	if (warm_obj && cJSON_IsNumber(warm_obj) && cJSON_GetNumberValue(warm_obj) > 0) {
+		warm->seconds = (uint32_t)cJSON_GetNumberValue(warm_obj);
+		rh_trace(LVL_DBG, "Devices kept warm for %u s\n", warm->seconds);
+	}
+
+	devices = cJSON_GetObjectItem(config_json, "warm_devices");
+	cJSON_ArrayForEach(dev_obj, devices) {
+		if (warm->device_count >= WARM_DEVICE_MAX_COUNT) {
+			rh_trace(LVL_ERR, "Too many warm devices\n");
+			break;
+		}
+
+		item = cJSON_GetObjectItem(dev_obj, "seconds");
+		if (!item || !cJSON_IsNumber(item) || cJSON_GetNumberValue(item) < 0)
+			continue;
+
+		dev = &warm->devices[warm->device_count];
+		memset(dev, 0, sizeof(*dev));
+		dev->seconds = (uint32_t)cJSON_GetNumberValue(item);
+
+		item = cJSON_GetObjectItem(dev_obj, "busid");
+		if (item && cJSON_IsString(item)) {
+			snprintf(dev->busid, USBIP_BUSID_SIZE, "%s", cJSON_GetStringValue(item));
+			rh_trace(LVL_DBG, "Device %s kept warm for %u s\n", dev->busid,
+					  dev->seconds);
+			warm->device_count++;
+			continue;
+		}
+
+		item = cJSON_GetObjectItem(dev_obj, "vid_pid");
+		if (!item || !cJSON_IsString(item) ||
+		    sscanf(cJSON_GetStringValue(item), "%4x:%4x", &vid, &pid) != 2) {
+			rh_trace(LVL_ERR, "Warm device without busid or vid_pid\n");
+			continue;
+		}
+
+		dev->vid = (uint16_t)vid;
+		dev->pid = (uint16_t)pid;
+		rh_trace(LVL_DBG, "Device %04x:%04x kept warm for %u s\n", dev->vid, dev->pid,
+				  dev->seconds);
+		warm->device_count++;
+	}
+}
+
 static cJSON *read_config(char *conf_path)
 {
 	FILE *f = NULL;
@@ -181,7 +379,8 @@ int rh_server_config_init(char *conf_path)
 {
 	cJSON *config_json, *version_obj;
 	cJSON *tls_obj, *bcast_obj, *cert_obj, *name_obj, *key_obj;
-	cJSON *keypass_obj, *port_obj;
+	cJSON *keypass_obj, *port_obj, *hugepages_obj, *io_uring_obj, *contexts_obj;
+	cJSON *prefetch_obj, *readahead_obj;
 	cJSON *buses = NULL, *bus = NULL, *busnum = NULL;
 
 	int conf_version = 1;
@@ -244,6 +443,42 @@ int rh_server_config_init(char *conf_path)
 				  (int)cJSON_GetNumberValue(port_obj));
 	}
 
+	hugepages_obj = cJSON_GetObjectItem(config_json, "pool_hugepages");
+	if (hugepages_obj && cJSON_IsTrue(hugepages_obj)) {
+		rh_trace(LVL_DBG, "Hugepage backed transfer buffers enabled\n");
+		info.pool_hugepages = true;
+	}
+
+	io_uring_obj = cJSON_GetObjectItem(config_json, "io_uring");
+	if (io_uring_obj && cJSON_IsTrue(io_uring_obj)) {
+		rh_trace(LVL_DBG, "io_uring forwarding requested\n");
+		info.io_uring = true;
+	}
+
+	contexts_obj = cJSON_GetObjectItem(config_json, "usb_contexts");
+	if (contexts_obj && cJSON_IsNumber(contexts_obj) &&
+	    cJSON_GetNumberValue(contexts_obj) > 0) {
+		info.usb_contexts = (uint32_t)cJSON_GetNumberValue(contexts_obj);
+		rh_trace(LVL_DBG, "Using %u libusb contexts\n", info.usb_contexts);
+	}
+
+	prefetch_obj = cJSON_GetObjectItem(config_json, "interrupt_prefetch");
+	if (prefetch_obj && cJSON_IsNumber(prefetch_obj) &&
+	    cJSON_GetNumberValue(prefetch_obj) > 0) {
+		info.int_prefetch = (uint32_t)cJSON_GetNumberValue(prefetch_obj);
+		rh_trace(LVL_DBG, "Interrupt IN prefetch depth %u\n", info.int_prefetch);
+	}
+
+	readahead_obj = cJSON_GetObjectItem(config_json, "storage_readahead");
+	if (readahead_obj && cJSON_IsTrue(readahead_obj)) {
+		rh_trace(LVL_DBG, "Mass storage read ahead enabled\n");
+		info.bot_readahead = true;
+	}
+
+	parse_tx_coalescing(config_json, &info.tx_coalesce);
+	parse_flow_control(config_json, &info.flow_control);
+	parse_keep_warm(config_json, &info.warm);
+
 	if (info.tls_enabled) {
 		cert_obj = cJSON_GetObjectItem(config_json, "cert_path");
 		if (!cert_obj || !cJSON_IsString(cert_obj)) {
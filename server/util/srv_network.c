@@ -19,10 +19,16 @@
 
 #include "srv_network.h"
 
-bool network_listen(struct server_conn *conn, struct est_conn *link)
+bool network_accept(struct server_conn *conn, struct est_conn *link)
 {
-	return conn->encryption ? network_listen_tls(conn, link) :
-				  network_listen_tcp(conn, link);
+	return conn->encryption ? network_accept_tls(conn, link) :
+				  network_accept_tcp(conn, link);
+}
+
+/* Nothing to negotiate on a plain TCP link */
+bool network_handshake(struct server_conn *conn, struct est_conn *link, uint32_t timeout_ms)
+{
+	return conn->encryption ? network_handshake_tls(conn, link, timeout_ms) : true;
 }
 
 bool network_create_server(struct server_conn *conn)
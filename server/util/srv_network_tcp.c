@@ -52,20 +52,19 @@ bool network_create_tcp_server(struct server_conn *conn)
 	rh_trace(LVL_DBG, "Server bound - Address: %s, port %d\n",
 			  inet_ntoa(srvaddr.sin_addr), conn->port);
 
+	if (listen(conn->socket, SERVER_LISTEN_BACKLOG) != 0) {
+		rh_trace(LVL_ERR, "Listen failed\n");
+		return false;
+	}
+
 	return true;
 }
 
-bool network_listen_tcp(struct server_conn *conn, struct est_conn *link)
+bool network_accept_tcp(struct server_conn *conn, struct est_conn *link)
 {
 	struct sockaddr_in cli;
 	socklen_t len;
 
-	rh_trace(LVL_TRC, "Listening...\n");
-	if ((listen(conn->socket, 5)) != 0) {
-		rh_trace(LVL_ERR, "Listen failed\n");
-		return false;
-	}
-
 	len = sizeof(struct sockaddr_in);
 
 	// TODO: Implement keepalive for detecting broken connection
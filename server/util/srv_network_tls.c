@@ -20,6 +20,9 @@
 #include <string.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <time.h>
+
+#include <pthread.h>
 
 #include "mbedtls/net_sockets.h"
 #include "mbedtls/debug.h"
@@ -31,6 +34,48 @@
 #include "srv_network.h"
 #include "logging.h"
 
+/* Deadline for the whole handshake, the reads get what is left of it */
+struct handshake_bio {
+	mbedtls_net_context	*fd;
+	struct timespec		deadline;
+};
+
+/* The handshakes run in parallel but share the server RNG */
+static pthread_mutex_t rng_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int locked_random(void *ctx, unsigned char *output, size_t len)
+{
+	int ret;
+
+	pthread_mutex_lock(&rng_lock);
+	ret = mbedtls_ctr_drbg_random(ctx, output, len);
+	pthread_mutex_unlock(&rng_lock);
+
+	return ret;
+}
+
+static int handshake_send(void *ctx, const unsigned char *buf, size_t len)
+{
+	struct handshake_bio *bio = ctx;
+
+	return mbedtls_net_send(bio->fd, buf, len);
+}
+
+static int handshake_recv(void *ctx, unsigned char *buf, size_t len)
+{
+	struct handshake_bio *bio = ctx;
+	struct timespec now;
+	int64_t left;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	left = (bio->deadline.tv_sec - now.tv_sec) * 1000 +
+	       (bio->deadline.tv_nsec - now.tv_nsec) / 1000000;
+	if (left <= 0)
+		return MBEDTLS_ERR_SSL_TIMEOUT;
+
+	return mbedtls_net_recv_timeout(bio->fd, buf, len, (uint32_t)left);
+}
+
 bool network_create_tls_server(struct server_conn *conn)
 {
 	int ret, one = 1;
@@ -74,6 +119,8 @@ bool network_create_tls_server(struct server_conn *conn)
 	/* TCP_NODELAY a gives noticeable speed increase when using f.ex mouse */
 	setsockopt(conn->tls.listen_fd.MBEDTLS_PRIVATE(fd), IPPROTO_TCP, TCP_NODELAY, &one,
 		   sizeof(one));
+	/* Raise the backlog mbedtls_net_bind listened with */
+	listen(conn->tls.listen_fd.MBEDTLS_PRIVATE(fd), SERVER_LISTEN_BACKLOG);
 
 	// TODO: Implement keepalive for detecting broken connection
 
@@ -86,7 +133,7 @@ bool network_create_tls_server(struct server_conn *conn)
 		goto err_exit;
 	}
 
-	mbedtls_ssl_conf_rng(&conn->tls.conf, mbedtls_ctr_drbg_random, &conn->tls.ctr_drbg);
+	mbedtls_ssl_conf_rng(&conn->tls.conf, locked_random, &conn->tls.ctr_drbg);
 
 	/*
 	 * TODO: Implement peer verification
@@ -113,44 +160,62 @@ err_exit:
 	return false;
 }
 
-bool network_listen_tls(struct server_conn *conn, struct est_conn *link)
+bool network_accept_tls(struct server_conn *conn, struct est_conn *link)
 {
 	int ret;
-	char buff[256];
 
 	mbedtls_ssl_init(&link->tls.ssl);
 	mbedtls_net_init(&link->tls.socket_fd);
 
 	link->encrypted = true;
 
-	ret = mbedtls_ssl_setup(&link->tls.ssl, &conn->tls.conf);
+	ret = mbedtls_net_accept(&conn->tls.listen_fd, &link->tls.socket_fd, NULL, 0, NULL);
 	if (ret != 0) {
-		rh_trace(LVL_ERR, "TLS setup failed (%d)\n", ret);
-		goto err_exit;
+		rh_trace(LVL_ERR, "Failed to accept connection (%d)\n", ret);
+		mbedtls_net_free(&link->tls.socket_fd);
+		mbedtls_ssl_free(&link->tls.ssl);
+		return false;
 	}
 
-	mbedtls_ssl_set_bio(&link->tls.ssl, &link->tls.socket_fd,
-			    mbedtls_net_send, mbedtls_net_recv, NULL);
+	return true;
+}
 
-	ret = mbedtls_net_accept(&conn->tls.listen_fd, &link->tls.socket_fd, NULL, 0, NULL);
+/* Gives up when the handshake has not completed within timeout_ms */
+bool network_handshake_tls(struct server_conn *conn, struct est_conn *link, uint32_t timeout_ms)
+{
+	struct handshake_bio bio;
+	char buff[256];
+	int ret;
+
+	ret = mbedtls_ssl_setup(&link->tls.ssl, &conn->tls.conf);
 	if (ret != 0) {
-		rh_trace(LVL_ERR, "Failed to accept connection (%d)\n", ret);
-		goto err_exit;
+		rh_trace(LVL_ERR, "TLS setup failed (%d)\n", ret);
+		return false;
 	}
 
+	bio.fd = &link->tls.socket_fd;
+	clock_gettime(CLOCK_MONOTONIC, &bio.deadline);
+	bio.deadline.tv_sec += timeout_ms / 1000;
+	bio.deadline.tv_nsec += (timeout_ms % 1000) * 1000000;
+	if (bio.deadline.tv_nsec >= 1000000000) {
+		bio.deadline.tv_sec++;
+		bio.deadline.tv_nsec -= 1000000000;
+	}
+
+	mbedtls_ssl_set_bio(&link->tls.ssl, &bio, handshake_send, handshake_recv, NULL);
+
 	while ((ret = mbedtls_ssl_handshake(&link->tls.ssl)) != 0) {
 		if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
 			mbedtls_strerror(ret, buff, sizeof(buff));
 			rh_trace(LVL_ERR, "TLS handshake failed %d (%s)\n", ret, buff);
-			goto err_exit;
+			return false;
 		}
 	}
 
+	mbedtls_ssl_set_bio(&link->tls.ssl, &link->tls.socket_fd,
+			    mbedtls_net_send, mbedtls_net_recv, NULL);
+
 	return true;
-err_exit:
-	mbedtls_net_free(&link->tls.socket_fd);
-	mbedtls_ssl_free(&link->tls.ssl);
-	return false;
 }
 
 void network_exit_server_tls(struct server_conn *conn)
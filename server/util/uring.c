@@ -0,0 +1,692 @@
+/*
+ * Copyright (C) 2021 Jani Laitinen
+ *
+ * This file is part of RemoteHub.
+ *
+ * RemoteHub is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * RemoteHub is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with RemoteHub.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "logging.h"
+#include "uring.h"
+
+#ifdef RH_HAVE_IO_URING
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <liburing.h>
+
+#include "reactor.h"
+
+/*
+ * One ring serves every plain TCP export. Receives are multishot into a ring
+ * of provided buffers, so a link needs no new submission per read. Handlers
+ * only prepare entries, the reactor submits them once per event batch and a
+ * single reaper at a time hands the completions to the links in order.
+ */
+
+struct uring_buf {
+	uint8_t				*data;
+	uint32_t			len;
+	int32_t				next;
+};
+
+struct uring_cqe_info {
+	struct uring_op			*op;
+	int				res;
+	uint32_t			flags;
+};
+
+static struct io_uring ring;
+static bool ring_ready;
+static bool sq_dirty;
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct io_uring_buf_ring *buf_ring;
+static uint8_t *buf_mem;
+static struct uring_buf bufs[URING_BUF_COUNT];
+
+static struct reactor_source cq_src = { .fd = -1 };
+
+/* Submission syscalls made for the links, logged when the ring goes away */
+static uint64_t ring_submits;
+
+/* Called with ring_lock held */
+static void submit_ring(void)
+{
+	ring_submits++;
+	(void) io_uring_submit(&ring);
+}
+
+/* Called with ring_lock held */
+static struct io_uring_sqe *get_sqe(void)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = io_uring_get_sqe(&ring);
+	if (!sqe) {
+		submit_ring();
+		sqe = io_uring_get_sqe(&ring);
+	}
+
+	if (sqe)
+		__atomic_store_n(&sq_dirty, true, __ATOMIC_RELEASE);
+
+	return sqe;
+}
+
+static void recycle_buf(int32_t bid)
+{
+	pthread_mutex_lock(&ring_lock);
+	io_uring_buf_ring_add(buf_ring, bufs[bid].data, URING_BUF_SIZE, bid,
+			      io_uring_buf_ring_mask(URING_BUF_COUNT), 0);
+	io_uring_buf_ring_advance(buf_ring, 1);
+	pthread_mutex_unlock(&ring_lock);
+}
+
+/* Submits what the handlers of one reactor batch have prepared */
+static void uring_flush(void)
+{
+	if (!__atomic_exchange_n(&sq_dirty, false, __ATOMIC_ACQ_REL))
+		return;
+
+	pthread_mutex_lock(&ring_lock);
+	submit_ring();
+	pthread_mutex_unlock(&ring_lock);
+}
+
+static void arm_recv(struct uring_link *ul)
+{
+	struct io_uring_sqe *sqe;
+
+	pthread_mutex_lock(ul->lock);
+	if (ul->recv_armed || ul->recv_closed) {
+		pthread_mutex_unlock(ul->lock);
+		return;
+	}
+	ul->recv_armed = true;
+	ul->ops++;
+	pthread_mutex_unlock(ul->lock);
+
+	pthread_mutex_lock(&ring_lock);
+	sqe = get_sqe();
+	if (sqe) {
+		io_uring_prep_recv_multishot(sqe, ul->fd, NULL, 0, 0);
+		io_uring_sqe_set_flags(sqe, IOSQE_BUFFER_SELECT);
+		sqe->buf_group = URING_BUF_GROUP;
+		io_uring_sqe_set_data(sqe, &ul->recv_op);
+	}
+	pthread_mutex_unlock(&ring_lock);
+
+	if (!sqe) {
+		rh_trace(LVL_ERR, "io_uring queue full\n");
+		pthread_mutex_lock(ul->lock);
+		ul->recv_armed = false;
+		ul->recv_closed = true;
+		ul->ops--;
+		pthread_mutex_unlock(ul->lock);
+	}
+}
+
+/* Called with the link lock held */
+static void complete_recv(struct uring_link *ul, int res, uint32_t flags)
+{
+	int32_t bid;
+
+	if (flags & IORING_CQE_F_BUFFER) {
+		bid = flags >> IORING_CQE_BUFFER_SHIFT;
+		bufs[bid].len = res > 0 ? res : 0;
+		bufs[bid].next = -1;
+		if (ul->rx_last < 0)
+			ul->rx_first = bid;
+		else
+			bufs[ul->rx_last].next = bid;
+		ul->rx_last = bid;
+	}
+
+	/* Out of buffers only pauses the receive until the link consumes some */
+	if (res == 0 || (res < 0 && res != -ENOBUFS))
+		ul->recv_closed = true;
+
+	if (!(flags & IORING_CQE_F_MORE)) {
+		ul->recv_armed = false;
+		ul->ops--;
+	}
+}
+
+static void complete(struct uring_cqe_info *info)
+{
+	struct uring_link *ul = info->op->link;
+
+	pthread_mutex_lock(ul->lock);
+
+	switch (info->op->type) {
+	case URING_OP_RECV:
+		complete_recv(ul, info->res, info->flags);
+		break;
+	case URING_OP_SEND:
+		/* Chunks linked after a short send come back cancelled */
+		if (info->res > 0)
+			ul->send_bytes += info->res;
+		else if (info->res != -ECANCELED && !ul->send_error)
+			ul->send_error = info->res ? info->res : -EPIPE;
+		ul->send_pending--;
+		ul->ops--;
+		break;
+	case URING_OP_CANCEL:
+		ul->ops--;
+		break;
+	}
+
+	pthread_mutex_unlock(ul->lock);
+}
+
+static void cq_handler(struct reactor_source *src, uint32_t events)
+{
+	struct io_uring_cqe *cqes[URING_REAP_BATCH];
+	struct uring_cqe_info done[URING_REAP_BATCH];
+	struct uring_link *notify[URING_REAP_BATCH];
+	int notify_count;
+	uint64_t count;
+	unsigned int n;
+
+	(void) events;
+
+	if (read(src->fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		rh_trace(LVL_DBG, "Ring eventfd read failed %d\n", errno);
+
+	/* The source is oneshot, so completions are handed over in ring order */
+	do {
+		pthread_mutex_lock(&ring_lock);
+		n = io_uring_peek_batch_cqe(&ring, cqes, URING_REAP_BATCH);
+		for (unsigned int i = 0; i < n; i++) {
+			done[i].op = (struct uring_op *)io_uring_cqe_get_data(cqes[i]);
+			done[i].res = cqes[i]->res;
+			done[i].flags = cqes[i]->flags;
+		}
+		io_uring_cq_advance(&ring, n);
+		pthread_mutex_unlock(&ring_lock);
+
+		notify_count = 0;
+		for (unsigned int i = 0; i < n; i++) {
+			complete(&done[i]);
+
+			for (int j = 0; j <= notify_count; j++) {
+				if (j == notify_count) {
+					notify[notify_count++] = done[i].op->link;
+					break;
+				}
+				if (notify[j] == done[i].op->link)
+					break;
+			}
+		}
+
+		for (int i = 0; i < notify_count; i++)
+			notify[i]->notify(notify[i]->ctx);
+	} while (n == URING_REAP_BATCH);
+
+	(void) reactor_rearm(src);
+}
+
+/* Multishot recv needs a newer kernel than the ring itself */
+static bool probe_multishot_recv(void)
+{
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	struct uring_link probe = {0};
+	int fds[2], bid, ret;
+	bool ok = false;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds))
+		return false;
+
+	probe.recv_op.link = &probe;
+
+	sqe = io_uring_get_sqe(&ring);
+	io_uring_prep_recv_multishot(sqe, fds[0], NULL, 0, 0);
+	io_uring_sqe_set_flags(sqe, IOSQE_BUFFER_SELECT);
+	sqe->buf_group = URING_BUF_GROUP;
+	io_uring_sqe_set_data(sqe, &probe.recv_op);
+
+	if (io_uring_submit(&ring) != 1 || write(fds[1], "", 1) != 1)
+		goto out;
+
+	ret = io_uring_wait_cqe(&ring, &cqe);
+	if (ret)
+		goto out;
+
+	ok = cqe->res == 1 && (cqe->flags & IORING_CQE_F_MORE);
+	if (cqe->flags & IORING_CQE_F_BUFFER) {
+		bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		io_uring_buf_ring_add(buf_ring, bufs[bid].data, URING_BUF_SIZE, bid,
+				      io_uring_buf_ring_mask(URING_BUF_COUNT), 0);
+		io_uring_buf_ring_advance(buf_ring, 1);
+	}
+	io_uring_cqe_seen(&ring, cqe);
+
+out:
+	/* Closing the socket ends the receive, its last completion is dropped here */
+	close(fds[1]);
+	close(fds[0]);
+	while (ok && !io_uring_wait_cqe(&ring, &cqe)) {
+		ret = cqe->flags & IORING_CQE_F_MORE;
+		io_uring_cqe_seen(&ring, cqe);
+		if (!ret)
+			break;
+	}
+
+	return ok;
+}
+
+bool uring_init(void)
+{
+	int ret;
+
+	ret = io_uring_queue_init(URING_ENTRIES, &ring, 0);
+	if (ret) {
+		rh_trace(LVL_DBG, "io_uring not available (%d)\n", ret);
+		return false;
+	}
+
+	buf_mem = malloc((size_t)URING_BUF_COUNT * URING_BUF_SIZE);
+	buf_ring = io_uring_setup_buf_ring(&ring, URING_BUF_COUNT, URING_BUF_GROUP, 0, &ret);
+	if (!buf_mem || !buf_ring) {
+		rh_trace(LVL_DBG, "io_uring buffer ring not available (%d)\n", ret);
+		goto err_ring;
+	}
+
+	for (int i = 0; i < URING_BUF_COUNT; i++) {
+		bufs[i].data = &buf_mem[(size_t)i * URING_BUF_SIZE];
+		io_uring_buf_ring_add(buf_ring, bufs[i].data, URING_BUF_SIZE, i,
+				      io_uring_buf_ring_mask(URING_BUF_COUNT), i);
+	}
+	io_uring_buf_ring_advance(buf_ring, URING_BUF_COUNT);
+
+	if (!probe_multishot_recv()) {
+		rh_trace(LVL_DBG, "io_uring multishot receive not supported\n");
+		goto err_ring;
+	}
+
+	cq_src.fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	cq_src.events = EPOLLIN | EPOLLONESHOT;
+	cq_src.handler = cq_handler;
+	if (cq_src.fd < 0 || io_uring_register_eventfd(&ring, cq_src.fd) || !reactor_add(&cq_src)) {
+		rh_trace(LVL_ERR, "io_uring completion event failed\n");
+		goto err_ring;
+	}
+
+	reactor_set_flush(uring_flush);
+	ring_ready = true;
+
+	rh_trace(LVL_DBG, "io_uring forwarding backend enabled\n");
+
+	return true;
+
+err_ring:
+	if (cq_src.fd >= 0)
+		close(cq_src.fd);
+	cq_src.fd = -1;
+	if (buf_ring)
+		io_uring_free_buf_ring(&ring, buf_ring, URING_BUF_COUNT, URING_BUF_GROUP);
+	buf_ring = NULL;
+	free(buf_mem);
+	buf_mem = NULL;
+	io_uring_queue_exit(&ring);
+	return false;
+}
+
+/* Links have been stopped and released before this */
+void uring_exit(void)
+{
+	if (!ring_ready)
+		return;
+
+	reactor_set_flush(NULL);
+	reactor_remove(&cq_src);
+	reactor_quiesce();
+
+	rh_trace(LVL_DBG, "io_uring submissions %llu\n", (unsigned long long)ring_submits);
+	ring_ready = false;
+	close(cq_src.fd);
+	cq_src.fd = -1;
+	io_uring_free_buf_ring(&ring, buf_ring, URING_BUF_COUNT, URING_BUF_GROUP);
+	buf_ring = NULL;
+	io_uring_queue_exit(&ring);
+	free(buf_mem);
+	buf_mem = NULL;
+}
+
+bool uring_link_start(struct uring_link *ul, int fd, pthread_mutex_t *lock,
+		      void (*notify)(void *ctx), void *ctx)
+{
+	memset(ul, 0, sizeof(*ul));
+	if (!ring_ready)
+		return false;
+
+	ul->fd = fd;
+	ul->lock = lock;
+	ul->notify = notify;
+	ul->ctx = ctx;
+	ul->rx_first = -1;
+	ul->rx_last = -1;
+	ul->recv_op.type = URING_OP_RECV;
+	ul->recv_op.link = ul;
+	ul->send_op.type = URING_OP_SEND;
+	ul->send_op.link = ul;
+	ul->cancel_op.type = URING_OP_CANCEL;
+	ul->cancel_op.link = ul;
+
+	/* Completions may run the owner before this returns */
+	ul->active = true;
+
+	arm_recv(ul);
+	if (ul->recv_closed) {
+		ul->active = false;
+		return false;
+	}
+
+	/* Not called from a reactor handler, nobody else would submit it */
+	pthread_mutex_lock(&ring_lock);
+	submit_ring();
+	pthread_mutex_unlock(&ring_lock);
+
+	return true;
+}
+
+void uring_link_stop(struct uring_link *ul)
+{
+	struct io_uring_sqe *sqe;
+
+	pthread_mutex_lock(ul->lock);
+	ul->recv_closed = true;
+	if (!ul->ops) {
+		pthread_mutex_unlock(ul->lock);
+		return;
+	}
+	ul->ops++;
+	pthread_mutex_unlock(ul->lock);
+
+	pthread_mutex_lock(&ring_lock);
+	sqe = get_sqe();
+	if (sqe) {
+		io_uring_prep_cancel_fd(sqe, ul->fd, IORING_ASYNC_CANCEL_ALL);
+		io_uring_sqe_set_data(sqe, &ul->cancel_op);
+	}
+	pthread_mutex_unlock(&ring_lock);
+
+	if (!sqe) {
+		rh_trace(LVL_ERR, "io_uring queue full, can not cancel\n");
+		pthread_mutex_lock(ul->lock);
+		ul->ops--;
+		pthread_mutex_unlock(ul->lock);
+	}
+}
+
+bool uring_link_idle(struct uring_link *ul)
+{
+	bool idle;
+
+	pthread_mutex_lock(ul->lock);
+	idle = !ul->ops;
+	pthread_mutex_unlock(ul->lock);
+
+	return idle;
+}
+
+/* Gives the received buffers back once the link is idle */
+void uring_link_release(struct uring_link *ul)
+{
+	int32_t bid;
+
+	while (ul->rx_first >= 0) {
+		bid = ul->rx_first;
+		ul->rx_first = bufs[bid].next;
+		recycle_buf(bid);
+	}
+	ul->rx_last = -1;
+
+	free(ul->msgs);
+	ul->msgs = NULL;
+	ul->msgs_size = 0;
+	ul->active = false;
+}
+
+/*
+ * Copies out what has been received, up to len. Returns the amount copied,
+ * zero when nothing has arrived yet and -1 once the link has been closed.
+ */
+int uring_recv(struct uring_link *ul, uint8_t *data, uint32_t len)
+{
+	uint32_t copied = 0, n;
+	int32_t bid;
+	bool closed;
+
+	while (copied < len) {
+		/* Completions only append, the head belongs to the reader */
+		pthread_mutex_lock(ul->lock);
+		bid = ul->rx_first;
+		pthread_mutex_unlock(ul->lock);
+
+		if (bid < 0)
+			break;
+
+		n = bufs[bid].len - ul->rx_offset;
+		if (n > len - copied)
+			n = len - copied;
+		memcpy(&data[copied], &bufs[bid].data[ul->rx_offset], n);
+		copied += n;
+		ul->rx_offset += n;
+
+		if (ul->rx_offset < bufs[bid].len)
+			break;
+
+		pthread_mutex_lock(ul->lock);
+		ul->rx_first = bufs[bid].next;
+		if (ul->rx_first < 0)
+			ul->rx_last = -1;
+		pthread_mutex_unlock(ul->lock);
+
+		ul->rx_offset = 0;
+		recycle_buf(bid);
+	}
+
+	/* A receive that ran out of buffers goes on now that some are back */
+	arm_recv(ul);
+
+	pthread_mutex_lock(ul->lock);
+	closed = ul->recv_closed && ul->rx_first < 0;
+	pthread_mutex_unlock(ul->lock);
+
+	if (copied)
+		return copied;
+
+	return closed ? -1 : 0;
+}
+
+static bool submit_send(struct uring_link *ul)
+{
+	struct io_uring_sqe *sqe;
+	struct msghdr *msgs;
+	int chunks = (ul->send_cnt + UIO_MAXIOV - 1) / UIO_MAXIOV;
+	int queued;
+
+	if (chunks > ul->msgs_size) {
+		msgs = realloc(ul->msgs, chunks * sizeof(struct msghdr));
+		if (!msgs) {
+			rh_trace(LVL_ERR, "Out of memory\n");
+			return false;
+		}
+		ul->msgs = msgs;
+		ul->msgs_size = chunks;
+	}
+
+	memset(ul->msgs, 0, chunks * sizeof(struct msghdr));
+	for (int i = 0; i < chunks; i++) {
+		ul->msgs[i].msg_iov = &ul->send_iov[i * UIO_MAXIOV];
+		ul->msgs[i].msg_iovlen = ul->send_cnt - i * UIO_MAXIOV > UIO_MAXIOV ?
+					 UIO_MAXIOV : ul->send_cnt - i * UIO_MAXIOV;
+	}
+
+	pthread_mutex_lock(ul->lock);
+	ul->send_pending = chunks;
+	ul->send_bytes = 0;
+	ul->send_error = 0;
+	ul->ops += chunks;
+	pthread_mutex_unlock(ul->lock);
+
+	pthread_mutex_lock(&ring_lock);
+
+	/* A chain split over two submissions would lose its ordering */
+	if (io_uring_sq_space_left(&ring) < (unsigned int)chunks)
+		submit_ring();
+
+	for (queued = 0; queued < chunks; queued++) {
+		sqe = get_sqe();
+		if (!sqe)
+			break;
+		io_uring_prep_sendmsg(sqe, ul->fd, &ul->msgs[queued], MSG_NOSIGNAL | MSG_WAITALL |
+				      (queued < chunks - 1 || ul->send_more ? MSG_MORE : 0));
+		if (queued < chunks - 1)
+			io_uring_sqe_set_flags(sqe, IOSQE_IO_LINK);
+		io_uring_sqe_set_data(sqe, &ul->send_op);
+	}
+
+	pthread_mutex_unlock(&ring_lock);
+
+	if (queued < chunks) {
+		rh_trace(LVL_ERR, "io_uring queue full, send dropped\n");
+		pthread_mutex_lock(ul->lock);
+		ul->send_pending -= chunks - queued;
+		ul->ops -= chunks - queued;
+		ul->send_error = -ENOSPC;
+		pthread_mutex_unlock(ul->lock);
+	}
+
+	return true;
+}
+
+/* Starts sending the vectors, they have to stay untouched until the send is done */
+bool uring_send(struct uring_link *ul, struct iovec *iov, int iovcnt, bool more)
+{
+	ul->send_iov = iov;
+	ul->send_cnt = iovcnt;
+	ul->send_more = more;
+
+	return submit_send(ul);
+}
+
+enum uring_send_state uring_send_poll(struct uring_link *ul)
+{
+	uint32_t pending;
+	uint64_t bytes;
+	int error;
+
+	pthread_mutex_lock(ul->lock);
+	pending = ul->send_pending;
+	bytes = ul->send_bytes;
+	error = ul->send_error;
+	pthread_mutex_unlock(ul->lock);
+
+	if (pending)
+		return URING_SEND_BUSY;
+
+	if (error || !bytes) {
+		rh_trace(LVL_WARN, "Network send fail %d\n", error);
+		return URING_SEND_FAILED;
+	}
+
+	while (ul->send_cnt > 0 && bytes >= ul->send_iov->iov_len) {
+		bytes -= ul->send_iov->iov_len;
+		ul->send_iov++;
+		ul->send_cnt--;
+	}
+
+	if (!ul->send_cnt)
+		return URING_SEND_DONE;
+
+	/* Short send, the chunks linked after it were cancelled */
+	ul->send_iov->iov_base = (uint8_t *)ul->send_iov->iov_base + bytes;
+	ul->send_iov->iov_len -= bytes;
+
+	return submit_send(ul) ? URING_SEND_BUSY : URING_SEND_FAILED;
+}
+
+#else
+
+bool uring_init(void)
+{
+	rh_trace(LVL_DBG, "io_uring support not built in\n");
+	return false;
+}
+
+void uring_exit(void)
+{
+}
+
+bool uring_link_start(struct uring_link *ul, int fd, pthread_mutex_t *lock,
+		      void (*notify)(void *ctx), void *ctx)
+{
+	(void) fd;
+	(void) lock;
+	(void) notify;
+	(void) ctx;
+
+	ul->active = false;
+	return false;
+}
+
+void uring_link_stop(struct uring_link *ul)
+{
+	(void) ul;
+}
+
+bool uring_link_idle(struct uring_link *ul)
+{
+	(void) ul;
+	return true;
+}
+
+void uring_link_release(struct uring_link *ul)
+{
+	ul->active = false;
+}
+
+int uring_recv(struct uring_link *ul, uint8_t *data, uint32_t len)
+{
+	(void) ul;
+	(void) data;
+	(void) len;
+	return -1;
+}
+
+bool uring_send(struct uring_link *ul, struct iovec *iov, int iovcnt, bool more)
+{
+	(void) ul;
+	(void) iov;
+	(void) iovcnt;
+	(void) more;
+	return false;
+}
+
+enum uring_send_state uring_send_poll(struct uring_link *ul)
+{
+	(void) ul;
+	return URING_SEND_FAILED;
+}
+
+#endif /* RH_HAVE_IO_URING */
@@ -0,0 +1,206 @@
+/*
+ * Copyright (C) 2021 Jani Laitinen
+ *
+ * This file is part of RemoteHub.
+ *
+ * RemoteHub is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * RemoteHub is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with RemoteHub.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+
+#include <pthread.h>
+
+#include "logging.h"
+#include "event.h"
+#include "srv_event.h"
+#include "usbip.h"
+#include "usb.h"
+#include "usb_import.h"
+
+/*
+ * Starting an export opens, claims and resets the device, which can take
+ * a while. The USB task marks the device as importing and a few workers do
+ * the rest, so other imports and the device scans go on meanwhile. The
+ * mark keeps a device from being imported twice or removed under a worker.
+ */
+
+struct import_job {
+	struct server_usb_device	*device;
+	struct est_conn			*link;
+	/* As the USB task had it, the names may still change meanwhile */
+	struct usbip_usb_device		udev;
+	struct import_job		*next;
+};
+
+static pthread_t workers[USB_IMPORT_WORKERS];
+static int worker_count;
+static bool running;
+
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_cond = PTHREAD_COND_INITIALIZER;
+static struct import_job *job_head;
+static struct import_job *job_tail;
+
+static bool start_export(struct import_job *job)
+{
+	struct server_usb_device *dev = job->device;
+	struct est_conn *link = job->link;
+	struct usbip_op_import_reply import_rep = {0};
+	struct usbip_op_common hdr = {0};
+
+	hdr.version = USBIP_DEFAULT_PROTOCOL_VERSION;
+	hdr.code = USBIP_OP_REP_IMPORT;
+	hdr.status = USBIP_ST_OK;
+
+	if (!usbip_net_send_usbip_header(link, &hdr)) {
+		rh_trace(LVL_ERR, "Failed to send USBIP header\n");
+		return false;
+	}
+
+	import_rep.udev = job->udev;
+
+	usbip_net_import_reply_to_network_order(&import_rep);
+	if (!network_send_data(link, (uint8_t *)&import_rep, sizeof(import_rep))) {
+		rh_trace(LVL_ERR, "Failed to send data\n");
+		return false;
+	}
+
+	/* The host task bounded the request with these, the export is long lived */
+	network_send_timeout_seconds_set(network_link_fd(link), 0);
+	network_recv_timeout_seconds_set(network_link_fd(link), 0);
+
+	dev->fwd.link = link;
+	if (!forwarding_start(dev)) {
+		rh_trace(LVL_ERR, "Device [%s] fwd failed\n", job->udev.busid);
+		dev->fwd.link = NULL;
+		return false;
+	}
+
+	rh_trace(LVL_TRC, "Device [%s] forwarding\n", job->udev.busid);
+
+	return true;
+}
+
+static void run_import(struct import_job *job)
+{
+	struct usb_import import = {0};
+	struct rh_event event = {0};
+
+	import.device = job->device;
+	import.ok = start_export(job);
+	if (!import.ok) {
+		network_close_link(job->link);
+		free(job->link);
+	}
+
+	event.type = EVENT_USB_IMPORTED;
+	event.data = &import;
+	event.size = sizeof(import);
+	(void) event_enqueue(&event);
+}
+
+static void *import_worker(void *arg)
+{
+	struct import_job *job;
+
+	(void) arg;
+
+	while (true) {
+		pthread_mutex_lock(&job_lock);
+		while (running && !job_head)
+			pthread_cond_wait(&job_cond, &job_lock);
+
+		if (!running) {
+			pthread_mutex_unlock(&job_lock);
+			break;
+		}
+
+		job = job_head;
+		job_head = job->next;
+		if (!job_head)
+			job_tail = NULL;
+		pthread_mutex_unlock(&job_lock);
+
+		run_import(job);
+		free(job);
+	}
+
+	return NULL;
+}
+
+/* Takes the link, the device must stay until EVENT_USB_IMPORTED */
+bool usb_import_request(struct server_usb_device *device, struct est_conn *link)
+{
+	struct import_job *job;
+
+	job = calloc(1, sizeof(struct import_job));
+	if (!job) {
+		rh_trace(LVL_ERR, "Out of memory\n");
+		return false;
+	}
+
+	job->device = device;
+	job->link = link;
+	job->udev = device->info.udev;
+
+	pthread_mutex_lock(&job_lock);
+	if (!job_tail)
+		job_head = job;
+	else
+		job_tail->next = job;
+	job_tail = job;
+	pthread_cond_signal(&job_cond);
+	pthread_mutex_unlock(&job_lock);
+
+	return true;
+}
+
+bool usb_import_init(void)
+{
+	running = true;
+
+	for (worker_count = 0; worker_count < USB_IMPORT_WORKERS; worker_count++) {
+		if (pthread_create(&workers[worker_count], NULL, import_worker, NULL)) {
+			rh_trace(LVL_ERR, "Failed to start USB import worker\n");
+			usb_import_exit();
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/* Imports already running are finished, the queued ones are dropped */
+void usb_import_exit(void)
+{
+	struct import_job *job;
+
+	pthread_mutex_lock(&job_lock);
+	running = false;
+	pthread_cond_broadcast(&job_cond);
+	pthread_mutex_unlock(&job_lock);
+
+	for (int i = 0; i < worker_count; i++)
+		pthread_join(workers[i], NULL);
+	worker_count = 0;
+
+	while (job_head) {
+		job = job_head;
+		job_head = job->next;
+		network_close_link(job->link);
+		free(job->link);
+		free(job);
+	}
+	job_tail = NULL;
+}
@@ -0,0 +1,287 @@
+/*
+ * Copyright (C) 2021 Jani Laitinen
+ *
+ * This file is part of RemoteHub.
+ *
+ * RemoteHub is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * RemoteHub is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with RemoteHub.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+
+#include <pthread.h>
+#include <libusb-1.0/libusb.h>
+
+#include "logging.h"
+#include "event.h"
+#include "srv_event.h"
+#include "usb_strings.h"
+
+/*
+ * Reading the strings means opening the device and running control
+ * transfers, which a slow device can stall for long. Devices are published
+ * with their binary descriptors and a few workers read the strings, so one
+ * device does not hold up the others. Results are collected until the USB
+ * task takes them, a single EVENT_USB_STRINGS announces all that finished
+ * in the meantime.
+ */
+
+struct strings_job {
+	struct libusb_device		*dev;
+	struct libusb_device_descriptor	desc;
+	struct strings_job		*next;
+};
+
+static pthread_t workers[USB_STRINGS_WORKERS];
+static int worker_count;
+static bool running;
+
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_cond = PTHREAD_COND_INITIALIZER;
+static struct strings_job *job_head;
+static struct strings_job *job_tail;
+
+/* Finished results, posted is set while an event for them is queued */
+static struct usb_strings *done_head;
+static struct usb_strings *done_tail;
+static bool posted;
+
+static int get_string_descriptor(libusb_device_handle *handle, uint8_t index,
+				 uint16_t langid, uint8_t *buf, int len)
+{
+	int ret;
+
+	ret = libusb_control_transfer(handle, LIBUSB_ENDPOINT_IN, LIBUSB_REQUEST_GET_DESCRIPTOR,
+				      (LIBUSB_DT_STRING << 8) | index, langid, buf, len,
+				      USB_STRINGS_TIMEOUT_MS);
+	if (ret < 0)
+		return ret;
+
+	if (ret < 2 || buf[1] != LIBUSB_DT_STRING)
+		return LIBUSB_ERROR_IO;
+
+	return buf[0] < ret ? buf[0] : ret;
+}
+
+/* Same as libusb_get_string_descriptor_ascii, but with our own timeout */
+static int read_string(libusb_device_handle *handle, uint8_t index, uint16_t langid,
+		       char *dest, int len)
+{
+	uint8_t buf[255];
+	int ret, n = 0;
+
+	memset(dest, 0, len);
+
+	if (!index)
+		return 0;
+
+	ret = get_string_descriptor(handle, index, langid, buf, sizeof(buf));
+	if (ret < 0)
+		return ret;
+
+	/* UTF-16LE, what does not fit ASCII shows as '?' */
+	for (int i = 2; i + 1 < ret && n < len - 1; i += 2)
+		dest[n++] = (buf[i + 1] || (buf[i] & 0x80)) ? '?' : (char)buf[i];
+
+	return n;
+}
+
+static void post_strings(struct usb_strings *strings)
+{
+	struct rh_event event = {0};
+	bool post;
+
+	pthread_mutex_lock(&job_lock);
+	if (!done_tail)
+		done_head = strings;
+	else
+		done_tail->next = strings;
+	done_tail = strings;
+	post = !posted;
+	posted = true;
+	pthread_mutex_unlock(&job_lock);
+
+	/* The results stay on the list, usb_strings_exit drops them if this fails */
+	if (post) {
+		event.type = EVENT_USB_STRINGS;
+		(void) event_enqueue(&event);
+	}
+}
+
+static void fetch_strings(struct strings_job *job)
+{
+	struct usb_strings *strings;
+	libusb_device_handle *handle;
+	uint8_t langs[4];
+	uint16_t langid;
+	int ret;
+
+	strings = calloc(1, sizeof(struct usb_strings));
+	if (!strings) {
+		rh_trace(LVL_ERR, "Out of memory\n");
+		libusb_unref_device(job->dev);
+		return;
+	}
+
+	strings->dev = job->dev;
+	strings->desc = job->desc;
+
+	ret = libusb_open(job->dev, &handle);
+	if (ret < 0) {
+		rh_trace(LVL_DBG, "Failed to open device %d, %s - %s\n",
+			 ret, libusb_error_name(ret), libusb_strerror(ret));
+		goto post;
+	}
+
+	strings->opened = true;
+
+	/* The first language the device lists is used */
+	ret = get_string_descriptor(handle, 0, 0, langs, sizeof(langs));
+	if (ret < 4) {
+		rh_trace(LVL_DBG, "Device has no string languages %d\n", ret);
+		libusb_close(handle);
+		goto post;
+	}
+	langid = langs[2] | (langs[3] << 8);
+
+	ret = read_string(handle, job->desc.iManufacturer, langid,
+			  strings->manufacturer_name, RH_DEVICE_NAME_MAX_LEN);
+	if (ret < 0)
+		rh_trace(LVL_DBG, "Device string 1 query failed: %d, %s - %s\n",
+			 ret, libusb_error_name(ret), libusb_strerror(ret));
+
+	ret = read_string(handle, job->desc.iProduct, langid,
+			  strings->product_name, RH_DEVICE_NAME_MAX_LEN);
+	if (ret < 0)
+		rh_trace(LVL_DBG, "Device string 2 query failed: %d, %s - %s\n",
+			 ret, libusb_error_name(ret), libusb_strerror(ret));
+
+	libusb_close(handle);
+
+post:
+	post_strings(strings);
+}
+
+static void *strings_worker(void *arg)
+{
+	struct strings_job *job;
+
+	(void) arg;
+
+	while (true) {
+		pthread_mutex_lock(&job_lock);
+		while (running && !job_head)
+			pthread_cond_wait(&job_cond, &job_lock);
+
+		if (!running) {
+			pthread_mutex_unlock(&job_lock);
+			break;
+		}
+
+		job = job_head;
+		job_head = job->next;
+		if (!job_head)
+			job_tail = NULL;
+		pthread_mutex_unlock(&job_lock);
+
+		fetch_strings(job);
+		free(job);
+	}
+
+	return NULL;
+}
+
+bool usb_strings_request(struct libusb_device *dev, struct libusb_device_descriptor *desc)
+{
+	struct strings_job *job;
+
+	job = calloc(1, sizeof(struct strings_job));
+	if (!job) {
+		rh_trace(LVL_ERR, "Out of memory\n");
+		return false;
+	}
+
+	job->dev = libusb_ref_device(dev);
+	job->desc = *desc;
+
+	pthread_mutex_lock(&job_lock);
+	if (!job_tail)
+		job_head = job;
+	else
+		job_tail->next = job;
+	job_tail = job;
+	pthread_cond_signal(&job_cond);
+	pthread_mutex_unlock(&job_lock);
+
+	return true;
+}
+
+/* Hands over everything read so far, the caller drops the references */
+struct usb_strings *usb_strings_take(void)
+{
+	struct usb_strings *strings;
+
+	pthread_mutex_lock(&job_lock);
+	strings = done_head;
+	done_head = NULL;
+	done_tail = NULL;
+	posted = false;
+	pthread_mutex_unlock(&job_lock);
+
+	return strings;
+}
+
+bool usb_strings_init(void)
+{
+	running = true;
+
+	for (worker_count = 0; worker_count < USB_STRINGS_WORKERS; worker_count++) {
+		if (pthread_create(&workers[worker_count], NULL, strings_worker, NULL)) {
+			rh_trace(LVL_ERR, "Failed to start USB string worker\n");
+			usb_strings_exit();
+			return false;
+		}
+	}
+
+	return true;
+}
+
+void usb_strings_exit(void)
+{
+	struct usb_strings *strings, *next;
+	struct strings_job *job;
+
+	pthread_mutex_lock(&job_lock);
+	running = false;
+	pthread_cond_broadcast(&job_cond);
+	pthread_mutex_unlock(&job_lock);
+
+	for (int i = 0; i < worker_count; i++)
+		pthread_join(workers[i], NULL);
+	worker_count = 0;
+
+	while (job_head) {
+		job = job_head;
+		job_head = job->next;
+		libusb_unref_device(job->dev);
+		free(job);
+	}
+	job_tail = NULL;
+
+	for (strings = usb_strings_take(); strings; strings = next) {
+		next = strings->next;
+		libusb_unref_device(strings->dev);
+		free(strings);
+	}
+}